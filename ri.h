@@ -1,11 +1,44 @@
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <iterator>
+#include <type_traits>
+#include <algorithm>
 #include <optional>
+#include <exception>
 #include <functional>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <system_error>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <cstring>
+#include <deque>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include <experimental/filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__linux__)
+#include <cerrno>
+#include <sys/epoll.h>
+#endif
 
 namespace ri
 {
@@ -24,10 +57,23 @@ namespace ri
     template <typename T>
     class Generator;
 
+    // Creates an arithmetic range with a known length
+    template <typename T>
+    class Range;
+
     // Empty Iterator
     template <typename T>
     class Empty;
 
+#if defined(__cpp_impl_coroutine)
+    // Coroutine returning generator<T> (C++20), usable as an iterator
+    template <typename T>
+    class generator;
+
+    template <typename T>
+    class CoroutineIter;
+#endif
+
     // Produces value once
     template <typename T>
     class Once;
@@ -52,6 +98,9 @@ namespace ri
     template <typename T>
     class Filter;
 
+    template <typename T>
+    class BatchFilter;
+
     template <typename Tin, typename Tout>
     class Map;
 
@@ -61,6 +110,9 @@ namespace ri
     template <typename Tin, typename Tout>
     class FlatMap;
 
+    template <typename Tin, typename Tout>
+    class FlatMapInto;
+
     template <typename T>
     class Inspect;
 
@@ -70,6 +122,17 @@ namespace ri
     template <typename Tfirst, typename Tsecond>
     class Zip;
 
+    // Zips any number of iterators into tuples of references
+    template <typename... Ts>
+    class ZipN;
+
+    // Zips random-access containers with a single index
+    template <typename... Containers>
+    class ZipIndexed;
+
+    template <typename T>
+    class Enumerate;
+
     template <typename T>
     class Chain;
 
@@ -79,1099 +142,6652 @@ namespace ri
     template <typename T>
     class Fuse;
 
-    template <typename Container>
-    auto iter(Container& c)
-    {
-        return std::make_shared<Iter<Container>>(c);
-    }
+    template <typename T, typename Source>
+    class Rev;
 
+    // Runs everything upstream on its own thread
     template <typename T>
-    auto gen(const T& start)
-    {
-        return std::make_shared<Generator<T>>(start, [](auto& n) { n++; });
-    }
+    class Staged;
+
+    template <typename Tin, typename Tout>
+    class ParMap;
 
+    // One upstream consumed by several threads
     template <typename T>
-    auto gen(const T& start, const T& end)
-    {
-        auto ltEnd = [=](auto& n) { return n < end; };
-        return gen(start)->take_while(ltEnd);;
-    }
+    class SharedSource;
 
     template <typename T>
-    auto gen(const T& start, const T& step, const T& end)
+    class SharedWorker;
+
+    template <typename Tin, typename Tout>
+    class ParFlatMap;
+
+    // Bounded MPMC channel between threads
+    template <typename T>
+    class Channel;
+
+    template <typename T>
+    class Sender;
+
+    template <typename T>
+    class Receiver;
+
+    // Push-based pipelines
+    template <typename T>
+    class Observer;
+
+    template <typename T, typename U, typename Build>
+    class Pipe;
+
+    // Runs adjacent map/filter/inspect adapters in a single node
+    template <typename Tin, typename Tout>
+    class Fused;
+
+    // Immutable callable shared by an adapter and its clones, so cloning
+    // never copies captured state
+    template <typename Signature>
+    class SharedFunction
     {
-        auto ltEnd = [=](auto& n) { return n < end; };
-        return std::make_shared<Generator<T>>(start, [=](auto& n) { n = n + step; })->take_while(ltEnd);
-    }
+        std::shared_ptr<const std::function<Signature>> _fun;
+
+      public:
+        SharedFunction() = default;
+        SharedFunction(std::function<Signature> fun)
+            : _fun(std::make_shared<const std::function<Signature>>(std::move(fun)))
+        {
+        }
+
+        template <typename... Args>
+        decltype(auto) operator()(Args&&... args) const
+        {
+            return (*_fun)(std::forward<Args>(args)...);
+        }
+    };
+
+    enum class StageKind
+    {
+        filter,
+        map,
+        inspect
+    };
 
+    // One stateless T -> T step of a Fused node
     template <typename T>
-    auto empty()
+    struct Stage
     {
-        return std::make_shared<Empty<T>>();
-    }
+        StageKind kind;
+        SharedFunction<bool(const T&)> predicate;
+        SharedFunction<T(const T&)> function;
+        SharedFunction<void(const T&)> inspector;
+
+        const char* name() const
+        {
+            switch (kind)
+            {
+                case StageKind::filter: return "filter";
+                case StageKind::map: return "map";
+                default: return "inspect";
+            }
+        }
+    };
 
+    // Integral types (except bool) are served by Range instead of Generator
     template <typename T>
-    auto once(const T& value)
+    constexpr bool is_range_type = std::is_integral<T>::value && !std::is_same<T, bool>::value;
+
+    // Containers collect() can reserve() ahead of time
+    template <typename Container, typename = void>
+    struct has_reserve : std::false_type {};
+
+    template <typename Container>
+    struct has_reserve<Container,
+        std::void_t<decltype(std::declval<Container&>().reserve(size_t()))>> : std::true_type {};
+
+    // Containers collect() can fill with n copies of a value in one call
+    template <typename Container, typename T, typename = void>
+    struct has_fill_insert : std::false_type {};
+
+    template <typename Container, typename T>
+    struct has_fill_insert<Container, T,
+        std::void_t<decltype(std::declval<Container&>().insert(
+            std::end(std::declval<Container&>()), size_t(), std::declval<const T&>()))>> : std::true_type {};
+
+    // Containers keeping their items in one array, such as vector
+    template <typename Container, typename = void>
+    struct has_data : std::false_type {};
+
+    template <typename Container>
+    struct has_data<Container,
+        std::void_t<decltype(std::declval<Container&>().data())>> : std::true_type {};
+
+    // Item type of an iterator class
+    template <typename It>
+    using item_t = std::remove_pointer_t<decltype(std::declval<It&>().next())>;
+
+    template <typename It>
+    struct is_random_access_iter : std::false_type {};
+
+    template <typename Container>
+    struct is_random_access_iter<Iter<Container>>
+        : std::integral_constant<bool, Iter<Container>::is_random_access> {};
+
+    // Spins briefly, then blocks until value no longer equals old
+    template <typename T>
+    void wait_while_equal(const std::atomic<T>& value, T old)
     {
-        return std::make_shared<Once<T>>(value);
+        for (int i = 0; i < 128; i++)
+        {
+            if (value.load(std::memory_order_acquire) != old)
+                return;
+        }
+
+#if defined(__cpp_lib_atomic_wait)
+        value.wait(old, std::memory_order_acquire);
+#else
+        while (value.load(std::memory_order_acquire) == old)
+            std::this_thread::yield();
+#endif
     }
 
     template <typename T>
-    auto repeat(const T& value)
+    void notify_waiters(std::atomic<T>& value)
     {
-        return std::make_shared<Repeat<T>>(value);
+#if defined(__cpp_lib_atomic_wait)
+        value.notify_all();
+#endif
     }
 
-    auto lines(const fs::path& path)
+    // Number of worker threads to use when the caller passes 0
+    inline size_t worker_count(size_t threads)
     {
-        return std::make_shared<LinesInFile>(path);
+        if (threads)
+            return threads;
+
+        return std::max<unsigned>(std::thread::hardware_concurrency(), 1);
     }
 
+    // Kahan-Neumaier running sum: compensation collects the low-order
+    // bits each addition rounds away
     template <typename T>
-    class IIterator : public std::enable_shared_from_this<IIterator<T>>
+    struct CompensatedSum
     {
-        public:
-            using Ptr = std::shared_ptr<IIterator>;
-
-            virtual T* next() = 0;
-            virtual IIterator<T>::Ptr clone() = 0;
-            virtual ~IIterator(){};
+        T sum = T(0);
+        T compensation = T(0);
 
-            auto last()
-            {
-                T* last = nullptr;
+        void add(T x)
+        {
+            auto t = sum + x;
+            compensation += std::abs(sum) >= std::abs(x) ? (sum - t) + x : (x - t) + sum;
+            sum = t;
+        }
 
-                while (auto item = next())
-                    last = item;
+        void add(const CompensatedSum& other)
+        {
+            add(other.sum);
+            compensation += other.compensation;
+        }
 
-                return last;
-            }
+        T value() const
+        {
+            return sum + compensation;
+        }
+    };
 
-            auto nth(int n)
-            {
-                int c = 0;
+    // Compensated sum of n contiguous values in eight independent lanes,
+    // merged in a fixed order so the result only depends on the input.
+    // AVX2 builds run the lanes with intrinsics for float and double;
+    // they do the same operations per lane, so results are bit-identical
+    // to the portable loop, which compilers don't reliably vectorize.
+    template <typename T>
+    CompensatedSum<T> sum_block(const T* data, size_t n)
+    {
+        constexpr size_t lanes = 8;
 
-                while (c < n)
-                {
-                    next();
-                    c++;
-                }
+        T sum[lanes] = {};
+        T compensation[lanes] = {};
+        size_t i = 0;
 
-                return next();
-            }
+#if defined(__AVX2__)
+        if constexpr (std::is_same<T, double>::value)
+        {
+            auto sign = _mm256_set1_pd(-0.0);
+            __m256d s[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
+            __m256d c[2] = {_mm256_setzero_pd(), _mm256_setzero_pd()};
 
-            auto take(int count)
+            for (; i + lanes <= n; i += lanes)
             {
-                return std::make_shared<Take<T>>(this->shared_from_this(), count);
+                for (size_t h = 0; h < 2; h++)
+                {
+                    auto x = _mm256_loadu_pd(data + i + 4 * h);
+                    auto t = _mm256_add_pd(s[h], x);
+                    auto sumBigger = _mm256_cmp_pd(_mm256_andnot_pd(sign, s[h]), _mm256_andnot_pd(sign, x), _CMP_GE_OQ);
+                    auto big = _mm256_blendv_pd(x, s[h], sumBigger);
+                    auto small = _mm256_blendv_pd(s[h], x, sumBigger);
+                    c[h] = _mm256_add_pd(c[h], _mm256_add_pd(_mm256_sub_pd(big, t), small));
+                    s[h] = t;
+                }
             }
 
-            auto filter(std::function<bool(const T&)> predicate)
+            for (size_t h = 0; h < 2; h++)
             {
-                return std::make_shared<Filter<T>>(this->shared_from_this(), predicate);
+                _mm256_storeu_pd(sum + 4 * h, s[h]);
+                _mm256_storeu_pd(compensation + 4 * h, c[h]);
             }
+        }
+        else if constexpr (std::is_same<T, float>::value)
+        {
+            auto sign = _mm256_set1_ps(-0.0f);
+            auto s = _mm256_setzero_ps();
+            auto c = _mm256_setzero_ps();
 
-            template <typename Tout>
-            auto map(std::function<Tout(const T&)> function)
+            for (; i + lanes <= n; i += lanes)
             {
-                return std::make_shared<Map<T, Tout>>(this->shared_from_this(), function);
+                auto x = _mm256_loadu_ps(data + i);
+                auto t = _mm256_add_ps(s, x);
+                auto sumBigger = _mm256_cmp_ps(_mm256_andnot_ps(sign, s), _mm256_andnot_ps(sign, x), _CMP_GE_OQ);
+                auto big = _mm256_blendv_ps(x, s, sumBigger);
+                auto small = _mm256_blendv_ps(s, x, sumBigger);
+                c = _mm256_add_ps(c, _mm256_add_ps(_mm256_sub_ps(big, t), small));
+                s = t;
             }
 
-            auto inspect(std::function<void(const T&)> function)
-            {
-                return std::make_shared<Inspect<T>>(this->shared_from_this(), function);
-            }
+            _mm256_storeu_ps(sum, s);
+            _mm256_storeu_ps(compensation, c);
+        }
+#endif
 
-            template <typename Tout>
-            auto filter_map(std::function<std::optional<Tout>(const T&)> function)
-            {
-                return std::make_shared<FilterMap<T, Tout>>(this->shared_from_this(), function);
-            }
-            
-            template <typename Tout>
-            auto flat_map(std::function<typename IIterator<Tout>::Ptr(const T&)> function)
+        for (; i + lanes <= n; i += lanes)
+        {
+            for (size_t l = 0; l < lanes; l++)
             {
-                return std::make_shared<FlatMap<T, Tout>>(this->shared_from_this(), function);
+                auto x = data[i + l];
+                auto t = sum[l] + x;
+                bool sumBigger = std::abs(sum[l]) >= std::abs(x);
+                auto big = sumBigger ? sum[l] : x;
+                auto small = sumBigger ? x : sum[l];
+                compensation[l] += (big - t) + small;
+                sum[l] = t;
             }
+        }
 
-            template <typename Tout>
-            auto scan(const Tout& init,
-                   std::function<Tout(const Tout&, const T&)> function)
-            {
-                return std::make_shared<Scan<T,Tout>>(this->shared_from_this(), init, function);
-            }
+        CompensatedSum<T> res;
 
-            template <typename Tother>
-            auto zip(typename IIterator<Tother>::Ptr other)
-            {
-                return std::make_shared<Zip<T, Tother>>(this->shared_from_this(), other);
-            }
+        for (size_t l = 0; l < lanes; l++)
+            res.add({sum[l], compensation[l]});
 
-            auto chain(IIterator<T>::Ptr other)
-            {
-                return std::make_shared<Chain<T>>(this->shared_from_this(), other);
-            }
+        for (; i < n; i++)
+            res.add(data[i]);
 
-            auto cycle()
-            {
-                return std::make_shared<Cycle<T>>(this->shared_from_this());
-            }
-            
+        return res;
+    }
 
-            //TODO: fold
-            //TODO: scan
-            //TODO: rev
-            //TODO: unzip
+    enum class CmpOp
+    {
+        lt,
+        le,
+        gt,
+        ge,
+        eq,
+        ne
+    };
 
-            auto enumerate()
-            {
-                auto nums = gen<size_t>(0);
-                return std::make_shared<Zip<size_t, T>>(nums, this->shared_from_this());
-            }
+    // Comparison of an item against a constant. filter() runs these in
+    // batches, comparing several items per instruction where it can.
+    template <typename T>
+    struct Comparison
+    {
+        CmpOp op;
+        T value;
 
-            auto take_while(std::function<bool(const T&)> pred)
+        template <typename U>
+        bool operator()(const U& item) const
+        {
+            switch (op)
             {
-                return std::make_shared<TakeWhile<T>>(this->shared_from_this(), pred);
+                case CmpOp::lt: return item < value;
+                case CmpOp::le: return item <= value;
+                case CmpOp::gt: return item > value;
+                case CmpOp::ge: return item >= value;
+                case CmpOp::eq: return item == value;
+                default: return item != value;
             }
+        }
+    };
 
-            auto skip(int count)
-            {
-                return std::make_shared<Skip<T>>(this->shared_from_this(), count);
-            }
-            
-            auto skip_while(std::function<bool(const T&)> pred)
-            {
-                return std::make_shared<SkipWhile<T>>(this->shared_from_this(), pred);
-            }
+    // Runs loop with the vector comparison matching op, so each op gets
+    // its own loop with the comparison as a compile-time immediate
+    template <typename Loop, typename Lt, typename Le, typename Gt, typename Ge, typename Eq, typename Ne>
+    void dispatch_comparison(CmpOp op, Loop loop, Lt lt, Le le, Gt gt, Ge ge, Eq eq, Ne ne)
+    {
+        switch (op)
+        {
+            case CmpOp::lt: loop(lt); break;
+            case CmpOp::le: loop(le); break;
+            case CmpOp::gt: loop(gt); break;
+            case CmpOp::ge: loop(ge); break;
+            case CmpOp::eq: loop(eq); break;
+            default: loop(ne); break;
+        }
+    }
 
-            auto fuse()
-            {
-                return std::make_shared<Fuse<T>>(this->shared_from_this());
-            }
+#if defined(__AVX2__) && !defined(__AVX512F__)
+    // For every 8-bit lane mask, the indices of the set lanes first:
+    // permuting by it packs the selected lanes to the front
+    struct PermutationTable
+    {
+        alignas(32) uint32_t indices[256][8];
 
-            template <template <typename, typename...> class Container, typename... Args>
-            auto collect()
+        constexpr PermutationTable()
+            : indices()
+        {
+            for (int mask = 0; mask < 256; mask++)
             {
-                Container<T, Args...> cont;
-                
-                while (auto item = next())
-                    cont.insert(std::end(cont), *item);
+                int k = 0;
 
-                return cont;
+                for (int lane = 0; lane < 8; lane++)
+                {
+                    if (mask & (1 << lane))
+                        indices[mask][k++] = uint32_t(lane);
+                }
             }
+        }
+    };
 
-            template <typename OutContainer>
-            auto collect()
-            {
-                OutContainer cont;
+    inline constexpr PermutationTable permutations{};
+#endif
 
-                while (auto item = next())
-                    cont.insert(std::end(cont), *item);
+    // Copies the items of in[0, n) that satisfy cmp to out, which has
+    // room for n items, and returns how many it copied. Built with
+    // AVX-512, floats, doubles and signed 32/64-bit integers are compared
+    // a vector at a time and packed with a compress store; with AVX2,
+    // floats and signed 32-bit integers are packed through a permutation
+    // table. The rest, and the tail, use a loop that always writes and
+    // only advances on a match, so it never branches on the data.
+    template <typename T>
+    size_t compress(const T* in, size_t n, T* out, const Comparison<T>& cmp)
+    {
+        size_t i = 0;
+        size_t k = 0;
 
-                return cont;
-            }
+#if defined(__AVX512F__)
+        constexpr bool int32 = std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4;
+        constexpr bool int64 = std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 8;
 
-            template <template <typename, typename...> class Container, typename... Args>
-            auto partition(std::function<bool (const T&)> pred)
-            {
-                Container<T, Args...> contTrue;
-                Container<T, Args...> contFalse;
-                
-                while (auto item = next())
+        if constexpr (std::is_same<T, float>::value)
+        {
+            auto value = _mm512_set1_ps(cmp.value);
+
+            auto loop = [&](auto compare) {
+                for (; i + 16 <= n; i += 16)
                 {
-                    if (pred(*item))
-                        contTrue.insert(std::end(contTrue), *item);
-                    else
-                        contFalse.insert(std::end(contFalse), *item);
+                    auto v = _mm512_loadu_ps(in + i);
+                    __mmask16 mask = compare(v, value);
+                    _mm512_mask_compressstoreu_ps(out + k, mask, v);
+                    k += __builtin_popcount(mask);
                 }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); },
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); },
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); },
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); },
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); },
+                [](__m512 a, __m512 b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); });
+        }
+        else if constexpr (std::is_same<T, double>::value)
+        {
+            auto value = _mm512_set1_pd(cmp.value);
 
-                return std::make_pair(contTrue, contFalse);
-            }
+            auto loop = [&](auto compare) {
+                for (; i + 8 <= n; i += 8)
+                {
+                    auto v = _mm512_loadu_pd(in + i);
+                    __mmask8 mask = compare(v, value);
+                    _mm512_mask_compressstoreu_pd(out + k, mask, v);
+                    k += __builtin_popcount(mask);
+                }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); },
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_LE_OQ); },
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_GT_OQ); },
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_GE_OQ); },
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_EQ_OQ); },
+                [](__m512d a, __m512d b) { return _mm512_cmp_pd_mask(a, b, _CMP_NEQ_UQ); });
+        }
+        else if constexpr (int32)
+        {
+            auto value = _mm512_set1_epi32(int32_t(cmp.value));
 
-            template <typename OutContainer>
-            auto partition(std::function<bool (const T&)> pred)
-            {
-                OutContainer contTrue;
-                OutContainer contFalse;
-                
-                while (auto item = next())
+            auto loop = [&](auto compare) {
+                for (; i + 16 <= n; i += 16)
                 {
-                    if (pred(*item))
-                        contTrue.insert(std::end(contTrue), *item);
-                    else
-                        contFalse.insert(std::end(contFalse), *item);
+                    auto v = _mm512_loadu_si512(in + i);
+                    __mmask16 mask = compare(v, value);
+                    _mm512_mask_compressstoreu_epi32(out + k, mask, v);
+                    k += __builtin_popcount(mask);
                 }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LT); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_LE); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLE); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NLT); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_EQ); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi32_mask(a, b, _MM_CMPINT_NE); });
+        }
+        else if constexpr (int64)
+        {
+            auto value = _mm512_set1_epi64(int64_t(cmp.value));
 
-                return std::make_pair(contTrue, contFalse);
-            }
+            auto loop = [&](auto compare) {
+                for (; i + 8 <= n; i += 8)
+                {
+                    auto v = _mm512_loadu_si512(in + i);
+                    __mmask8 mask = compare(v, value);
+                    _mm512_mask_compressstoreu_epi64(out + k, mask, v);
+                    k += __builtin_popcount(mask);
+                }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_LT); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_LE); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NLE); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NLT); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_EQ); },
+                [](__m512i a, __m512i b) { return _mm512_cmp_epi64_mask(a, b, _MM_CMPINT_NE); });
+        }
+#elif defined(__AVX2__)
+        constexpr bool int32 = std::is_integral<T>::value && std::is_signed<T>::value && sizeof(T) == 4;
+
+        // Packs the lanes set in mask to out + k; writes all 8 lanes, which
+        // stays within out since k <= i
+        auto store = [&](__m256i v, int mask) {
+            auto indices = _mm256_load_si256(reinterpret_cast<const __m256i*>(permutations.indices[mask]));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + k), _mm256_permutevar8x32_epi32(v, indices));
+            k += __builtin_popcount(mask);
+        };
+
+        if constexpr (std::is_same<T, float>::value)
+        {
+            auto value = _mm256_set1_ps(cmp.value);
 
-            bool all(std::function<bool(const T&)> predicate)
+            auto loop = [&](auto compare) {
+                for (; i + 8 <= n; i += 8)
+                {
+                    auto v = _mm256_loadu_ps(in + i);
+                    store(_mm256_castps_si256(v), _mm256_movemask_ps(compare(v, value)));
+                }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); },
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); },
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); },
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); },
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); },
+                [](__m256 a, __m256 b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); });
+        }
+        else if constexpr (int32)
+        {
+            auto value = _mm256_set1_epi32(int32_t(cmp.value));
+
+            // AVX2 only compares for > and ==; the rest swap or invert
+            auto bits = [](__m256i m) { return _mm256_movemask_ps(_mm256_castsi256_ps(m)); };
+
+            auto loop = [&](auto compare) {
+                for (; i + 8 <= n; i += 8)
+                {
+                    auto v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+                    store(v, compare(v, value));
+                }
+            };
+
+            dispatch_comparison(cmp.op, loop,
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpgt_epi32(b, a)); },
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpgt_epi32(a, b)) ^ 0xff; },
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpgt_epi32(a, b)); },
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpgt_epi32(b, a)) ^ 0xff; },
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpeq_epi32(a, b)); },
+                [&](__m256i a, __m256i b) { return bits(_mm256_cmpeq_epi32(a, b)) ^ 0xff; });
+        }
+#endif
+
+        for (; i < n; i++)
+        {
+            out[k] = in[i];
+            k += cmp(in[i]);
+        }
+
+        return k;
+    }
+
+    // Open-addressing hash table with linear probing, filled by a single
+    // thread. Slots keep each key's mixed hash, so growing the table or
+    // partitioning its entries never hashes a key twice.
+    template <typename K, typename V>
+    class FlatTable
+    {
+        struct Slot
+        {
+            size_t hash;
+            std::optional<std::pair<K, V>> entry;
+        };
+
+        std::vector<Slot> _slots;
+        size_t _size;
+
+        Slot& find(const K& key, size_t hash)
+        {
+            auto mask = _slots.size() - 1;
+
+            for (auto i = hash & mask; ; i = (i + 1) & mask)
+            {
+                auto& slot = _slots[i];
+
+                if (!slot.entry || (slot.hash == hash && slot.entry->first == key))
+                    return slot;
+            }
+        }
+
+        // Doubles the slots, keeping the load factor at or under one half
+        void grow()
+        {
+            auto old = std::move(_slots);
+            _slots = std::vector<Slot>(old.size() * 2);
+
+            for (auto& slot : old)
+            {
+                if (slot.entry)
+                {
+                    auto& target = find(slot.entry->first, slot.hash);
+                    target.hash = slot.hash;
+                    target.entry = std::move(slot.entry);
+                }
+            }
+        }
+
+      public:
+        FlatTable()
+            : _slots(16)
+            , _size(0)
+        {
+        }
+
+        // std::hash is the identity for integers, so its bits are mixed
+        // before they pick a slot or a partition
+        static size_t hash(const K& key)
+        {
+            uint64_t h = std::hash<K>()(key);
+            h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+            return size_t(h ^ (h >> 31));
+        }
+
+        // Value stored under key, inserting a copy of init if it's new
+        V& get(const K& key, size_t hash, const V& init)
+        {
+            if (2 * (_size + 1) > _slots.size())
+                grow();
+
+            auto& slot = find(key, hash);
+
+            if (!slot.entry)
+            {
+                slot.hash = hash;
+                slot.entry.emplace(key, init);
+                _size++;
+            }
+
+            return slot.entry->second;
+        }
+
+        // Inserts entry, or merges its value into the one already there
+        template <typename Merge>
+        void merge(size_t hash, std::pair<K, V>&& entry, const Merge& merge)
+        {
+            if (2 * (_size + 1) > _slots.size())
+                grow();
+
+            auto& slot = find(entry.first, hash);
+
+            if (slot.entry)
+            {
+                merge(slot.entry->second, std::move(entry.second));
+            }
+            else
+            {
+                slot.hash = hash;
+                slot.entry.emplace(std::move(entry));
+                _size++;
+            }
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        // Moves every entry out to fun(hash, entry) and empties the table
+        template <typename Fun>
+        void drain(const Fun& fun)
+        {
+            for (auto& slot : _slots)
+            {
+                if (slot.entry)
+                    fun(slot.hash, std::move(*slot.entry));
+            }
+
+            _slots = std::vector<Slot>(16);
+            _size = 0;
+        }
+    };
+
+    // Where plan_parallel() gets the cost of an item from
+    enum class ItemCost
+    {
+        assumed,
+        measured
+    };
+
+    // How a parallel terminal runs: threads == 1 means sequentially, and
+    // grain is how many items a worker claims at a time
+    struct ParallelPlan
+    {
+        size_t threads;
+        size_t grain;
+    };
+
+    // Keeps a per-thread value on its own cache line
+    template <typename T>
+    struct alignas(64) CachePadded
+    {
+        T value;
+    };
+
+    // Runs task(0) .. task(count - 1) on count threads, the calling one
+    // included, and rethrows the first exception a task threw. Tasks
+    // run inline if no more threads can be started.
+    inline void run_parallel(size_t count, const std::function<void(size_t)>& task)
+    {
+        std::vector<std::exception_ptr> errors(count);
+        std::vector<std::thread> threads;
+
+        auto run = [&](size_t i) {
+            try
+            {
+                task(i);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        };
+
+        size_t started = 1;
+
+        try
+        {
+            for (; started < count; started++)
+                threads.emplace_back(run, started);
+        }
+        catch (const std::system_error&)
+        {
+        }
+
+        for (size_t i = started; i < count; i++)
+            run(i);
+
+        if (count)
+            run(0);
+
+        for (auto& thread : threads)
+            thread.join();
+
+        for (auto& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+    }
+
+    template <typename Container>
+    auto iter(Container& c)
+    {
+        return std::make_shared<Iter<Container>>(c);
+    }
+
+    template <typename T>
+    auto gen(const T& start)
+    {
+        return std::make_shared<Generator<T>>(start, [](auto& n) { n++; });
+    }
+
+    template <typename T>
+    auto gen(const T& start, const T& end)
+    {
+        if constexpr (is_range_type<T>)
+        {
+            return std::make_shared<Range<T>>(start, T(1), end);
+        }
+        else
+        {
+            auto ltEnd = [=](auto& n) { return n < end; };
+            return gen(start)->take_while(ltEnd);
+        }
+    }
+
+    // Integral ranges throw std::invalid_argument when start < end and
+    // step isn't positive, as the sequence would never reach end
+    template <typename T>
+    auto gen(const T& start, const T& step, const T& end)
+    {
+        if constexpr (is_range_type<T>)
+        {
+            return std::make_shared<Range<T>>(start, step, end);
+        }
+        else
+        {
+            auto ltEnd = [=](auto& n) { return n < end; };
+            return std::make_shared<Generator<T>>(start, [=](auto& n) { n = n + step; })->take_while(ltEnd);
+        }
+    }
+
+    template <typename T>
+    auto empty()
+    {
+        return std::make_shared<Empty<T>>();
+    }
+
+    template <typename T>
+    auto once(const T& value)
+    {
+        return std::make_shared<Once<T>>(value);
+    }
+
+    template <typename T>
+    auto repeat(const T& value)
+    {
+        return std::make_shared<Repeat<T>>(value);
+    }
+
+    auto lines(const fs::path& path)
+    {
+        return std::make_shared<LinesInFile>(path);
+    }
+
+    // Sender and receiver of a bounded channel holding up to capacity
+    // items (rounded up to a power of two). Both ends can be used from
+    // any number of threads.
+    template <typename T>
+    auto channel(size_t capacity)
+    {
+        auto state = std::make_shared<Channel<T>>(capacity);
+        return std::make_pair(Sender<T>(state), std::make_shared<Receiver<T>>(state));
+    }
+
+    // Start of a push pipeline taking items of type T
+    template <typename T>
+    auto observe()
+    {
+        auto build = [](auto down) { return down; };
+        return Pipe<T, T, decltype(build)>(build);
+    }
+
+    // Comparisons against a constant, for filter() to run in batches
+    template <typename T>
+    auto less(const T& value)
+    {
+        return Comparison<T>{CmpOp::lt, value};
+    }
+
+    template <typename T>
+    auto less_equal(const T& value)
+    {
+        return Comparison<T>{CmpOp::le, value};
+    }
+
+    template <typename T>
+    auto greater(const T& value)
+    {
+        return Comparison<T>{CmpOp::gt, value};
+    }
+
+    template <typename T>
+    auto greater_equal(const T& value)
+    {
+        return Comparison<T>{CmpOp::ge, value};
+    }
+
+    template <typename T>
+    auto equal_to(const T& value)
+    {
+        return Comparison<T>{CmpOp::eq, value};
+    }
+
+    template <typename T>
+    auto not_equal_to(const T& value)
+    {
+        return Comparison<T>{CmpOp::ne, value};
+    }
+
+    template <typename... Its>
+    auto zip(std::shared_ptr<Its>... iters)
+    {
+        if constexpr ((is_random_access_iter<Its>::value && ...))
+            return std::make_shared<ZipIndexed<typename Its::container_type...>>(*iters...);
+        else
+            return std::make_shared<ZipN<item_t<Its>...>>(iters...);
+    }
+
+    template <typename T>
+    class IIterator : public std::enable_shared_from_this<IIterator<T>>
+    {
+        public:
+            using Ptr = std::shared_ptr<IIterator>;
+
+            virtual T* next() = 0;
+            // Independent cursor over the remaining items. Adapters clone
+            // their upstream too; immutable parts such as functions and
+            // file mappings are shared rather than copied.
+            virtual IIterator<T>::Ptr clone() = 0;
+            virtual ~IIterator(){};
+
+            // Lower bound and optional upper bound on the number of
+            // remaining items. No upper bound means unknown or infinite.
+            virtual std::pair<size_t, std::optional<size_t>> size_hint()
+            {
+                return {0, {}};
+            }
+
+            // True when the iterator never runs out. size_hint() can't say
+            // so, but take() and zip() use it to report an exact size.
+            virtual bool infinite()
+            {
+                return false;
+            }
+
+            // Splits the remaining items in two: this iterator keeps the
+            // front part and the returned one yields the back part.
+            // Returns nullptr when the iterator can't be split.
+            virtual IIterator<T>::Ptr split()
+            {
+                return nullptr;
+            }
+
+            // Independent iterator over the remaining items [from, to),
+            // leaving this one untouched. Safe to call from several threads
+            // at once. Returns nullptr unless the source has random access.
+            virtual IIterator<T>::Ptr slice(size_t /*from*/, size_t /*to*/)
+            {
+                return nullptr;
+            }
+
+            // Skips up to n items and returns how many were skipped.
+            // Sources that know their layout do it without visiting items.
+            virtual size_t advance_by(size_t n)
+            {
+                size_t i = 0;
+
+                while (i < n && next())
+                    i++;
+
+                return i;
+            }
+
+            // Remaining items as an array of len items the caller may
+            // read until the next call, or nullptr if they aren't stored
+            // contiguously. Batched adapters read it in place.
+            virtual const T* contiguous(size_t& /*len*/)
+            {
+                return nullptr;
+            }
+
+            // Value every remaining item is equal to, or nullptr if the
+            // items may differ. Lets terminals fill instead of iterate.
+            virtual T* repeated_value()
+            {
+                return nullptr;
+            }
+
+            // Exposes a stateless adapter as its source plus the stages it
+            // runs, so the next stateless adapter can be fused into it.
+            virtual bool fusion_parts(IIterator<T>::Ptr& /*source*/, std::vector<Stage<T>>& /*stages*/)
+            {
+                return false;
+            }
+
+            // Returns a single node running this adapter followed by
+            // stage, or nullptr if this adapter can't be fused.
+            virtual IIterator<T>::Ptr fused_with(const Stage<T>& stage)
+            {
+                IIterator<T>::Ptr source;
+                std::vector<Stage<T>> stages;
+
+                if (!fusion_parts(source, stages))
+                    return nullptr;
+
+                stages.push_back(stage);
+                return std::make_shared<Fused<T, T>>(source, stages);
+            }
+
+            // True when size_hint() is exact, i.e. lower == upper
+            bool exact_size(size_t& len)
             {
+                auto [lower, upper] = size_hint();
+                len = lower;
+                return upper && *upper == lower;
+            }
+
+            T* last()
+            {
+                size_t len;
+
+                if (exact_size(len))
+                {
+                    if (len == 0)
+                        return nullptr;
+
+                    advance_by(len - 1);
+                    return next();
+                }
+
+                T* last = nullptr;
+
                 while (auto item = next())
-                    if (!predicate(*item))
-                        return false;
+                    last = item;
+
+                return last;
+            }
+
+            T* nth(int n)
+            {
+                if (n > 0)
+                    advance_by(n);
+
+                return next();
+            }
+
+            auto take(int count)
+            {
+                return std::make_shared<Take<T>>(this->shared_from_this(), count);
+            }
+
+            // filter(), map() and inspect() return IIterator<T>::Ptr rather
+            // than their adapter type, since appending to a Filter, Map,
+            // Inspect or Fused node yields a single Fused node. Code that
+            // named std::shared_ptr<Filter<T>> and the like should use auto
+            // or IIterator<T>::Ptr instead.
+            IIterator<T>::Ptr filter(std::function<bool(const T&)> predicate)
+            {
+                if (auto fused = fused_with({StageKind::filter, predicate, {}, {}}))
+                    return fused;
+
+                return std::make_shared<Filter<T>>(this->shared_from_this(), predicate);
+            }
+
+            // Filters arithmetic items in batches, comparing several per
+            // instruction and packing the survivors without branching on
+            // them. Yields copies, so items can't be modified through it.
+            // Falls back to filter() with the comparison as a predicate
+            // when T isn't arithmetic or value doesn't convert to T exactly.
+            template <typename V>
+            IIterator<T>::Ptr filter(const Comparison<V>& comparison)
+            {
+                if constexpr (std::is_arithmetic<T>::value && std::is_convertible<V, T>::value)
+                {
+                    if (V(T(comparison.value)) == comparison.value)
+                    {
+                        return std::make_shared<BatchFilter<T>>(this->shared_from_this(),
+                            Comparison<T>{comparison.op, T(comparison.value)});
+                    }
+                }
+
+                return filter(std::function<bool(const T&)>(comparison));
+            }
+
+            template <typename Tout>
+            typename IIterator<Tout>::Ptr map(std::function<Tout(const T&)> function)
+            {
+                if constexpr (std::is_same<T, Tout>::value)
+                {
+                    if (auto fused = fused_with({StageKind::map, {}, function, {}}))
+                        return fused;
+                }
+                else
+                {
+                    IIterator<T>::Ptr source;
+                    std::vector<Stage<T>> stages;
+
+                    if (fusion_parts(source, stages))
+                        return std::make_shared<Fused<T, Tout>>(source, stages, function);
+                }
+
+                return std::make_shared<Map<T, Tout>>(this->shared_from_this(), function);
+            }
+
+            IIterator<T>::Ptr inspect(std::function<void(const T&)> function)
+            {
+                if (auto fused = fused_with({StageKind::inspect, {}, {}, function}))
+                    return fused;
+
+                return std::make_shared<Inspect<T>>(this->shared_from_this(), function);
+            }
+
+            // Like map, but function runs on threads worker threads (0 means
+            // one per core). Results keep upstream order; at most window
+            // items (0 means 4 per thread) are buffered at a time.
+            template <typename Tout>
+            auto par_map(std::function<Tout(const T&)> function, size_t threads = 0, size_t window = 0)
+            {
+                return std::make_shared<ParMap<T, Tout>>(this->shared_from_this(), function, threads, window);
+            }
+
+            template <typename Tout>
+            auto filter_map(std::function<std::optional<Tout>(const T&)> function)
+            {
+                return std::make_shared<FilterMap<T, Tout>>(this->shared_from_this(), function);
+            }
+            
+            template <typename Tout>
+            auto flat_map(std::function<typename IIterator<Tout>::Ptr(const T&)> function)
+            {
+                return std::make_shared<FlatMap<T, Tout>>(this->shared_from_this(), function);
+            }
+
+            // Like flat_map, but expands items on threads worker threads (0
+            // means one per core) and yields the results in no particular
+            // order. Large inner iterators are split between threads.
+            template <typename Tout>
+            auto par_flat_map(std::function<typename IIterator<Tout>::Ptr(const T&)> function, size_t threads = 0)
+            {
+                return std::make_shared<ParFlatMap<T, Tout>>(this->shared_from_this(), function, threads);
+            }
+
+            // Like flat_map, but function appends the expansion of an item
+            // to a buffer that is reused for every item
+            template <typename Tout>
+            auto flat_map_into(std::function<void(const T&, std::vector<Tout>&)> function)
+            {
+                return std::make_shared<FlatMapInto<T, Tout>>(this->shared_from_this(), function);
+            }
+
+            template <typename Tout>
+            auto scan(const Tout& init,
+                   std::function<Tout(const Tout&, const T&)> function)
+            {
+                return std::make_shared<Scan<T,Tout>>(this->shared_from_this(), init, function);
+            }
+
+            template <typename Tother>
+            auto zip(typename IIterator<Tother>::Ptr other)
+            {
+                return std::make_shared<Zip<T, Tother>>(this->shared_from_this(), other);
+            }
+
+            auto chain(IIterator<T>::Ptr other)
+            {
+                return std::make_shared<Chain<T>>(this->shared_from_this(), other);
+            }
+
+            // With a bufferCapacity, items of the first pass are recorded (up
+            // to that many) and replayed instead of re-running the source
+            auto cycle(size_t bufferCapacity = 0)
+            {
+                return std::make_shared<Cycle<T>>(this->shared_from_this(), bufferCapacity);
+            }
+            
+
+            //TODO: fold
+            //TODO: scan
+            //TODO: rev for sources other than integral gen() ranges
+
+            // Yields (index, item) pairs referring to the upstream items
+            auto enumerate()
+            {
+                return std::make_shared<Enumerate<T>>(this->shared_from_this());
+            }
+
+            auto take_while(std::function<bool(const T&)> pred)
+            {
+                return std::make_shared<TakeWhile<T>>(this->shared_from_this(), pred);
+            }
+
+            auto skip(int count)
+            {
+                return std::make_shared<Skip<T>>(this->shared_from_this(), count);
+            }
+            
+            auto skip_while(std::function<bool(const T&)> pred)
+            {
+                return std::make_shared<SkipWhile<T>>(this->shared_from_this(), pred);
+            }
+
+            auto fuse()
+            {
+                return std::make_shared<Fuse<T>>(this->shared_from_this());
+            }
+
+            // Runs everything upstream of this point on a dedicated thread,
+            // buffering up to capacity items handed over in batches.
+            // Dropping the stage waits for the upstream's current next().
+            auto stage(size_t capacity = 4096, size_t batchSize = 64)
+            {
+                return std::make_shared<Staged<T>>(this->shared_from_this(), capacity, batchSize);
+            }
+
+            // Pushes the remaining items into observer until it asks to
+            // stop, then completes it
+            void push_into(std::shared_ptr<Observer<T>> observer)
+            {
+                while (auto item = next())
+                {
+                    if (!observer->on_next(*item))
+                        break;
+                }
+
+                observer->on_complete();
+            }
+
+            // Hands the remaining items out to several threads, chunk items
+            // at a time; each thread iterates its own share()->worker().
+            // This iterator yields none of them afterwards.
+            auto share(size_t chunk = 256)
+            {
+                return std::make_shared<SharedSource<T>>(this->shared_from_this(), chunk);
+            }
+
+            template <template <typename, typename...> class Container, typename... Args>
+            auto collect()
+            {
+                return collect<Container<T, Args...>>();
+            }
+
+            template <typename OutContainer>
+            auto collect()
+            {
+                OutContainer cont;
+                size_t len;
+                bool exact = exact_size(len);
+
+                if constexpr (has_fill_insert<OutContainer, T>::value)
+                {
+                    if (exact)
+                    if (auto value = repeated_value())
+                    {
+                        cont.insert(std::end(cont), len, *value);
+                        advance_by(len);
+                        return cont;
+                    }
+                }
+
+                if constexpr (has_reserve<OutContainer>::value)
+                    cont.reserve(size_hint().first);
+
+                while (auto item = next())
+                    cont.insert(std::end(cont), *item);
+
+                return cont;
+            }
+
+            template <template <typename, typename...> class Container, typename... Args>
+            auto partition(std::function<bool (const T&)> pred)
+            {
+                Container<T, Args...> contTrue;
+                Container<T, Args...> contFalse;
+                
+                while (auto item = next())
+                {
+                    if (pred(*item))
+                        contTrue.insert(std::end(contTrue), *item);
+                    else
+                        contFalse.insert(std::end(contFalse), *item);
+                }
+
+                return std::make_pair(contTrue, contFalse);
+            }
+
+            template <typename OutContainer>
+            auto partition(std::function<bool (const T&)> pred)
+            {
+                OutContainer contTrue;
+                OutContainer contFalse;
+                
+                while (auto item = next())
+                {
+                    if (pred(*item))
+                        contTrue.insert(std::end(contTrue), *item);
+                    else
+                        contFalse.insert(std::end(contFalse), *item);
+                }
+
+                return std::make_pair(contTrue, contFalse);
+            }
+
+            // Splits pairs (or tuples) into a container of first and a
+            // container of second components, in one pass
+            template <template <typename, typename...> class Container, typename... Args>
+            auto unzip()
+            {
+                using First = std::decay_t<std::tuple_element_t<0, T>>;
+                using Second = std::decay_t<std::tuple_element_t<1, T>>;
+
+                return unzip<Container<First, Args...>, Container<Second, Args...>>();
+            }
+
+            template <typename ContainerA, typename ContainerB>
+            auto unzip()
+            {
+                ContainerA contA;
+                ContainerB contB;
+                auto lower = size_hint().first;
+
+                if constexpr (has_reserve<ContainerA>::value)
+                    contA.reserve(lower);
+
+                if constexpr (has_reserve<ContainerB>::value)
+                    contB.reserve(lower);
+
+                while (auto item = next())
+                {
+                    contA.insert(std::end(contA), std::get<0>(*item));
+                    contB.insert(std::end(contB), std::get<1>(*item));
+                }
+
+                return std::make_pair(std::move(contA), std::move(contB));
+            }
+
+            bool all(std::function<bool(const T&)> predicate)
+            {
+                while (auto item = next())
+                    if (!predicate(*item))
+                        return false;
+
+                return true;
+            }
+
+            bool any(std::function<bool(const T&)> predicate)
+            {
+                while (auto item = next())
+                    if (predicate(*item))
+                        return true;
+
+                return false;
+            }
+
+            T* find(std::function<bool(const T&)> predicate)
+            {
+                while (auto item = next())
+                    if (predicate(*item))
+                        return item;
+
+                return nullptr;
+            }
+
+            std::optional<size_t> position(std::function<bool(const T&)> predicate)
+            {
+                size_t count = 0;
+
+                while (auto item = next())
+                    if (predicate(*item))
+                        return count;
+                    else
+                        ++count;
+
+                return {};
+            }
+
+            // Picks worker threads and grain for a parallel terminal. An
+            // explicit thread count is kept. With 0, it's derived from
+            // size_hint at an assumed cost per item, so each thread gets
+            // enough work to pay for starting it; small inputs and inputs
+            // of unknown size run sequentially. With ItemCost::measured,
+            // the cost is instead timed by running per_item on a short
+            // prefix of a clone, and an unknown size counts as at least
+            // that prefix. The prefix is then evaluated twice, so upstream
+            // side effects and per_item's own run twice for it, and
+            // cloning may start work (e.g. a stage's thread); only measure
+            // pure, cheap sources.
+            ParallelPlan plan_parallel(size_t threads, const std::function<void(const T&)>& per_item,
+                    ItemCost cost = ItemCost::assumed)
+            {
+                using namespace std::chrono;
+
+                constexpr double threadNs = 100000;
+                constexpr double chunkNs = 20000;
+                constexpr size_t probeItems = 64;
+
+                auto [lower, upper] = size_hint();
+                auto items = upper ? *upper : lower;
+
+                if (threads)
+                {
+                    auto grain = items ? items / (threads * 8) : 256;
+                    return {threads, std::clamp<size_t>(grain, 1, 4096)};
+                }
+
+                double itemNs = 100;
+                IIterator<T>::Ptr probe;
+
+                try
+                {
+                    if (cost == ItemCost::measured)
+                        probe = clone();
+                }
+                catch (const std::logic_error&)
+                {
+                }
+
+                if (probe)
+                {
+                    size_t n = 0;
+                    auto start = steady_clock::now();
+                    auto elapsed = steady_clock::duration::zero();
+
+                    while (n < probeItems && elapsed < microseconds(50))
+                    {
+                        auto item = probe->next();
+
+                        // Ran out during the probe, so the size is known
+                        if (!item)
+                        {
+                            items = n;
+                            upper = n;
+                            break;
+                        }
+
+                        per_item(*item);
+                        elapsed = steady_clock::now() - start;
+                        n++;
+                    }
+
+                    if (n)
+                        itemNs = std::max(double(duration_cast<nanoseconds>(elapsed).count()) / n, 1.0);
+
+                    if (!upper)
+                        items = std::max(items, n);
+                }
+
+                // Without a size, items is only a lower bound, often 0
+                auto cores = worker_count(0);
+                threads = std::clamp<size_t>(size_t(std::min(items * itemNs / threadNs, double(cores))), 1, cores);
+
+                auto grain = std::clamp<size_t>(size_t(chunkNs / itemNs), 1, 65536);
+
+                if (items)
+                    grain = std::min(grain, std::max<size_t>(items / (threads * 4), 1));
+
+                return {threads, grain};
+            }
+
+            // Looks for an item matching predicate on plan.threads worker
+            // threads that claim slices of plan.grain items in order. With
+            // leftmost set, workers skip
+            // slices that can't beat the best match so far and found is the
+            // first match; otherwise the first match seen stops them all.
+            // Leaves this iterator untouched and returns false if it can't
+            // be sliced.
+            bool par_search(const std::function<bool(const T&)>& predicate, const ParallelPlan& plan,
+                    bool leftmost, std::optional<size_t>& found)
+            {
+                size_t len;
+
+                if (!exact_size(len) || !slice(0, 0))
+                    return false;
+
+                auto chunk = plan.grain;
+                CachePadded<std::atomic<size_t>> cursor;
+                CachePadded<std::atomic<size_t>> best;
+
+                cursor.value.store(0);
+                best.value.store(len);
+
+                auto beaten = [&](size_t i) {
+                    auto match = best.value.load(std::memory_order_relaxed);
+                    return leftmost ? i >= match : match < len;
+                };
+
+                run_parallel(plan.threads, [&](size_t) {
+                    while (true)
+                    {
+                        auto from = cursor.value.fetch_add(chunk, std::memory_order_relaxed);
+
+                        if (from >= len || beaten(from))
+                            return;
+
+                        auto to = std::min(from + chunk, len);
+                        auto part = slice(from, to);
+
+                        for (auto i = from; i < to; i++)
+                        {
+                            if ((i - from) % 64 == 0 && beaten(i))
+                                return;
+
+                            if (predicate(*part->next()))
+                            {
+                                auto match = best.value.load(std::memory_order_relaxed);
+
+                                while (i < match && !best.value.compare_exchange_weak(match, i))
+                                {
+                                }
+
+                                // Any later slice this worker claims is past i
+                                return;
+                            }
+                        }
+                    }
+                });
+
+                if (best.value < len)
+                    found = best.value.load();
+
+                return true;
+            }
+
+            // Parallel position(): still the index of the first match, and
+            // leaves the iterator just past it
+            std::optional<size_t> par_position(std::function<bool(const T&)> predicate, size_t threads = 0)
+            {
+                std::optional<size_t> found;
+                auto plan = plan_parallel(threads, [&](const T& item) { predicate(item); });
+
+                if (plan.threads == 1 || !par_search(predicate, plan, true, found))
+                    return position(predicate);
+
+                size_t len;
+                exact_size(len);
+                advance_by(found ? *found + 1 : len);
+                return found;
+            }
+
+            // Parallel find(): still the first match, and leaves the iterator
+            // just past it
+            T* par_find(std::function<bool(const T&)> predicate, size_t threads = 0)
+            {
+                std::optional<size_t> found;
+                auto plan = plan_parallel(threads, [&](const T& item) { predicate(item); });
+
+                if (plan.threads == 1 || !par_search(predicate, plan, true, found))
+                    return find(predicate);
+
+                size_t len;
+                exact_size(len);
+
+                if (!found)
+                {
+                    advance_by(len);
+                    return nullptr;
+                }
+
+                advance_by(*found);
+                return next();
+            }
+
+            // Parallel any(). Stops at whichever match is seen first, so
+            // unlike any() it may consume the whole iterator. Sources that
+            // can't be sliced are shared out in batches.
+            bool par_any(std::function<bool(const T&)> predicate, size_t threads = 0)
+            {
+                std::optional<size_t> found;
+                auto plan = plan_parallel(threads, [&](const T& item) { predicate(item); });
+
+                if (plan.threads == 1)
+                    return any(predicate);
+
+                if (par_search(predicate, plan, false, found))
+                {
+                    size_t len;
+                    exact_size(len);
+                    advance_by(len);
+                    return found.has_value();
+                }
+
+                auto source = share(plan.grain);
+                std::atomic<bool> hit(false);
+
+                run_parallel(plan.threads, [&](size_t) {
+                    auto worker = source->worker();
+
+                    while (!hit.load(std::memory_order_relaxed))
+                    {
+                        auto item = worker->next();
+
+                        if (!item)
+                            return;
+
+                        if (predicate(*item))
+                            hit.store(true, std::memory_order_relaxed);
+                    }
+                });
+
+                return hit;
+            }
+
+            // Parallel all(); may consume the iterator like par_any()
+            bool par_all(std::function<bool(const T&)> predicate, size_t threads = 0)
+            {
+                return !par_any([&](const T& item) { return !predicate(item); }, threads);
+            }
+
+            // Number of times each distinct item occurs
+            std::unordered_map<T, size_t> counts()
+            {
+                std::unordered_map<T, size_t> res;
+
+                while (auto item = next())
+                    res[*item]++;
+
+                return res;
+            }
+
+            // Items grouped by key, each group in iteration order
+            template <typename K>
+            std::unordered_map<K, std::vector<T>> group_by(std::function<K(const T&)> key)
+            {
+                std::unordered_map<K, std::vector<T>> res;
+
+                while (auto item = next())
+                    res[key(*item)].push_back(*item);
+
+                return res;
+            }
+
+            // Aggregates the remaining items by key on worker threads. Each
+            // worker adds its items into its own FlatTable, starting every
+            // key from init. The tables are then radix partitioned by hash,
+            // and each partition is merged by one thread, so there's no
+            // shared table and no lock. Partial values are merged in worker
+            // order, which is iteration order for sources that can be
+            // sliced or split.
+            template <typename K, typename V>
+            std::unordered_map<K, V> par_aggregate(std::function<K(const T&)> key, const V& init,
+                    std::function<void(V&, const T&)> add, std::function<void(V&, V&&)> merge,
+                    size_t threads = 0)
+            {
+                auto plan = plan_parallel(threads, [&](const T& item) { key(item); });
+
+                if (plan.threads == 1)
+                {
+                    std::unordered_map<K, V> res;
+
+                    while (auto item = next())
+                        add(res.try_emplace(key(*item), init).first->second, *item);
+
+                    return res;
+                }
+
+                auto parts = split_into(plan.threads);
+                auto workers = parts.size() > 1 ? parts.size() : plan.threads;
+                auto source = parts.size() > 1 ? nullptr : share(plan.grain);
+
+                // A few partitions per worker, so merging balances out
+                size_t bits = 0;
+
+                while ((size_t(1) << bits) < 4 * workers)
+                    bits++;
+
+                auto partitions = size_t(1) << bits;
+                auto partition = [&](size_t hash) { return hash >> (sizeof(size_t) * 8 - bits); };
+
+                using Entry = std::pair<size_t, std::pair<K, V>>;
+                std::vector<std::vector<std::vector<Entry>>> buckets(workers, std::vector<std::vector<Entry>>(partitions));
+
+                run_parallel(workers, [&](size_t w) {
+                    FlatTable<K, V> table;
+                    auto iter = source ? source->worker() : parts[w];
+
+                    while (auto item = iter->next())
+                    {
+                        auto k = key(*item);
+                        add(table.get(k, FlatTable<K, V>::hash(k), init), *item);
+                    }
+
+                    table.drain([&](size_t hash, std::pair<K, V>&& entry) {
+                        buckets[w][partition(hash)].emplace_back(hash, std::move(entry));
+                    });
+                });
+
+                std::vector<FlatTable<K, V>> merged(partitions);
+                std::atomic<size_t> cursor(0);
+
+                run_parallel(workers, [&](size_t) {
+                    for (auto p = cursor++; p < partitions; p = cursor++)
+                    {
+                        for (size_t w = 0; w < workers; w++)
+                        {
+                            for (auto& [hash, entry] : buckets[w][p])
+                                merged[p].merge(hash, std::move(entry), merge);
+
+                            std::vector<Entry>().swap(buckets[w][p]);
+                        }
+                    }
+                });
+
+                size_t total = 0;
+
+                for (auto& table : merged)
+                    total += table.size();
+
+                std::unordered_map<K, V> res;
+                res.reserve(total);
+
+                for (auto& table : merged)
+                {
+                    table.drain([&](size_t, std::pair<K, V>&& entry) {
+                        res.emplace(std::move(entry));
+                    });
+                }
+
+                return res;
+            }
+
+            // Parallel counts()
+            std::unordered_map<T, size_t> par_counts(size_t threads = 0)
+            {
+                return par_aggregate<T, size_t>(
+                    [](const T& item) { return item; }, 0,
+                    [](size_t& count, const T&) { count++; },
+                    [](size_t& count, size_t&& other) { count += other; },
+                    threads);
+            }
+
+            // Parallel group_by(); groups keep iteration order when the
+            // source can be sliced or split
+            template <typename K>
+            std::unordered_map<K, std::vector<T>> par_group_by(std::function<K(const T&)> key, size_t threads = 0)
+            {
+                return par_aggregate<K, std::vector<T>>(key, {},
+                    [](std::vector<T>& group, const T& item) { group.push_back(item); },
+                    [](std::vector<T>& group, std::vector<T>&& other) {
+                        group.insert(group.end(), std::make_move_iterator(other.begin()),
+                                     std::make_move_iterator(other.end()));
+                    },
+                    threads);
+            }
+
+            std::optional<T> max()
+            {
+                return max_by([](auto& a, auto& b) { return a < b; });
+            }
+            
+            std::optional<T> max_by(std::function<bool(const T& a, const T& b)> cmp)
+            {
+                std::optional<T> max;
+
+                while (auto item = next())
+                {
+                    if (!max)
+                        max = *item;
+                    else if (!cmp(*item, *max))
+                        max = *item;
+                }
+
+                return max;
+            }
+
+            std::optional<T> min()
+            {
+                return min_by([](auto& a, auto& b) { return a < b; });
+            }
+
+            std::optional<T> min_by(std::function<bool(const T& a, const T& b)> cmp)
+            {
+                std::optional<T> min;
+
+                while (auto item = next())
+                {
+                    if (!min)
+                        min = *item;
+                    else if (cmp(*item, *min))
+                        min = *item;
+                }
+
+                return min;
+            }
+
+            void for_each(std::function<void(const T&)> fun)
+            {
+                while (auto item = next())
+                    fun(*item);
+            }
+
+            size_t count()
+            {
+                size_t len;
+
+                if (exact_size(len))
+                    return advance_by(len);
+
+                size_t cnt = 0;
+
+                while (next())
+                    cnt++;
+
+                return cnt;
+            }
+
+            T sum()
+            {
+                T sum = T(0);
+
+                while(auto item = next())
+                    sum = sum + *item;
+
+                return sum;
+            }
+            
+            // Sum of floating point items that is compensated against
+            // rounding and reproducible: items are summed in fixed blocks
+            // of 4096 whose results are merged in a fixed pairwise tree, so
+            // neither the thread count nor timing changes a single bit.
+            // Blocks run in parallel when the iterator can be sliced.
+            T sum_precise(size_t threads = 0)
+            {
+                if constexpr (!std::is_floating_point<T>::value)
+                {
+                    return sum();
+                }
+                else
+                {
+                    constexpr size_t block = 4096;
+
+                    std::vector<CompensatedSum<T>> blocks;
+                    size_t len;
+
+                    auto plan = plan_parallel(threads, [](const T&) {});
+
+                    if (plan.threads > 1 && exact_size(len) && slice(0, 0))
+                    {
+                        blocks.resize((len + block - 1) / block);
+
+                        std::atomic<size_t> cursor(0);
+
+                        run_parallel(plan.threads, [&](size_t) {
+                            std::vector<T> buffer(block);
+
+                            for (auto k = cursor++; k < blocks.size(); k = cursor++)
+                            {
+                                auto from = k * block;
+                                auto n = std::min(block, len - from);
+                                auto part = slice(from, from + n);
+
+                                for (size_t i = 0; i < n; i++)
+                                    buffer[i] = *part->next();
+
+                                blocks[k] = sum_block(buffer.data(), n);
+                            }
+                        });
+
+                        advance_by(len);
+                    }
+                    else
+                    {
+                        std::vector<T> buffer(block);
+                        size_t n = 0;
+
+                        while (auto item = next())
+                        {
+                            buffer[n++] = *item;
+
+                            if (n == block)
+                            {
+                                blocks.push_back(sum_block(buffer.data(), n));
+                                n = 0;
+                            }
+                        }
+
+                        if (n)
+                            blocks.push_back(sum_block(buffer.data(), n));
+                    }
+
+                    for (size_t step = 1; step < blocks.size(); step *= 2)
+                    {
+                        for (size_t i = 0; i + step < blocks.size(); i += 2 * step)
+                            blocks[i].add(blocks[i + step]);
+                    }
+
+                    return blocks.empty() ? T(0) : blocks[0].value();
+                }
+            }
+
+            T product()
+            {
+                T prod = T(1);
+
+                while(auto item = next())
+                    prod = prod * *item;
+
+                return prod;
+            }
+
+            template <typename Tout>
+            auto fold(const Tout& init,
+                    std::function<Tout(const Tout& acc, const T& current)> function)
+            {
+                Tout res = init;
+
+                while (auto item = next())
+                    res = function(res, *item);
+
+                return res;
+            }
+
+            // Collects the remaining items into a vector on threads worker
+            // threads, keeping their order. Exact-size sources that can be
+            // sliced are written straight into their slots. Others are split
+            // and each thread fills a segment of its own; the segments are
+            // then moved into place in parallel. Sources that can be neither
+            // sliced nor split are collected sequentially.
+            std::vector<T> par_collect(size_t threads = 0)
+            {
+                threads = plan_parallel(threads, [](const T&) {}).threads;
+
+                if (threads == 1)
+                    return collect<std::vector>();
+
+                if constexpr (std::is_default_constructible<T>::value)
+                {
+                    size_t len;
+
+                    if (exact_size(len) && slice(0, 0))
+                    {
+                        std::vector<T> out(len);
+
+                        run_parallel(threads, [&](size_t i) {
+                            auto from = len * i / threads;
+                            auto to = len * (i + 1) / threads;
+                            auto part = slice(from, to);
+
+                            for (auto k = from; k < to; k++)
+                                out[k] = *part->next();
+                        });
+
+                        advance_by(len);
+                        return out;
+                    }
+                }
+
+                auto parts = split_into(threads);
+
+                if (parts.size() == 1)
+                    return collect<std::vector>();
+
+                std::vector<std::vector<T>> segments(parts.size());
+
+                run_parallel(parts.size(), [&](size_t i) {
+                    segments[i] = parts[i]->template collect<std::vector>();
+                });
+
+                // Where each segment starts in the output
+                std::vector<size_t> offsets(parts.size() + 1, 0);
+
+                for (size_t i = 0; i < segments.size(); i++)
+                    offsets[i + 1] = offsets[i] + segments[i].size();
+
+                std::vector<T> out;
+
+                if constexpr (std::is_default_constructible<T>::value)
+                {
+                    out.resize(offsets.back());
+
+                    run_parallel(segments.size(), [&](size_t i) {
+                        std::move(segments[i].begin(), segments[i].end(), out.begin() + offsets[i]);
+                    });
+                }
+                else
+                {
+                    out.reserve(offsets.back());
+
+                    for (auto& segment : segments)
+                        std::move(segment.begin(), segment.end(), std::back_inserter(out));
+                }
+
+                return out;
+            }
+
+            // Inclusive running op over the remaining items, like
+            // scan(init, op)->collect<std::vector>(), computed as a two-pass
+            // blocked prefix scan on threads worker threads. op must be
+            // associative. Sources that can't be sliced are scanned in order.
+            std::vector<T> par_scan(const T& init, std::function<T(const T&, const T&)> op, size_t threads = 0)
+            {
+                size_t len;
+
+                if (!exact_size(len) || !slice(0, 0))
+                    return scan<T>(init, op)->template collect<std::vector>();
+
+                threads = plan_parallel(threads, [&](const T& item) { op(init, item); }).threads;
+                threads = std::min(threads, std::max<size_t>(len, 1));
+
+                std::vector<T> out(len, init);
+                std::vector<T> carries(threads, init);
+                auto begin = [&](size_t block) { return len * block / threads; };
+
+                // Scan each block on its own, the first one from init
+                run_parallel(threads, [&](size_t block) {
+                    auto from = begin(block);
+                    auto to = begin(block + 1);
+                    auto part = slice(from, to);
+
+                    if (from == to)
+                        return;
+
+                    out[from] = block == 0 ? op(init, *part->next()) : *part->next();
+
+                    for (auto i = from + 1; i < to; i++)
+                        out[i] = op(out[i - 1], *part->next());
+                });
+
+                // Carry into a block combines everything before it; blocks
+                // are never empty since threads <= len
+                for (size_t block = 1; block < threads; block++)
+                {
+                    auto total = out[begin(block) - 1];
+                    carries[block] = block == 1 ? total : op(carries[block - 1], total);
+                }
+
+                run_parallel(threads - 1, [&](size_t i) {
+                    auto block = i + 1;
+
+                    for (auto k = begin(block); k < begin(block + 1); k++)
+                        out[k] = op(carries[block], out[k]);
+                });
+
+                advance_by(len);
+                return out;
+            }
+
+            // Splits the remaining items into at most parts iterators that
+            // together yield them in order, by slicing or splitting. Returns
+            // just this iterator when it can do neither.
+            std::vector<IIterator<T>::Ptr> split_into(size_t parts)
+            {
+                size_t len;
+
+                if (parts > 1 && exact_size(len) && slice(0, 0))
+                {
+                    std::vector<IIterator<T>::Ptr> res;
+
+                    for (size_t i = 0; i < parts; i++)
+                        res.push_back(slice(len * i / parts, len * (i + 1) / parts));
+
+                    advance_by(len);
+                    return res;
+                }
+
+                std::vector<IIterator<T>::Ptr> res = {this->shared_from_this()};
+
+                while (res.size() < parts)
+                {
+                    std::vector<IIterator<T>::Ptr> halves;
+
+                    for (size_t i = 0; i < res.size(); i++)
+                    {
+                        halves.push_back(res[i]);
+
+                        if (halves.size() + res.size() - i - 1 < parts)
+                        {
+                            if (auto back = res[i]->split())
+                                halves.push_back(back);
+                        }
+                    }
+
+                    if (halves.size() == res.size())
+                        break;
+
+                    res = halves;
+                }
+
+                return res;
+            }
+
+            // Folds the remaining items on threads worker threads (0 lets
+            // plan_parallel() choose), then merges the partial results pairwise with
+            // combine. combine must be associative with identity as its
+            // neutral element. Sources that can't be sliced or split are
+            // folded sequentially, unless commutative says combine also
+            // commutes; they are then shared out in batches.
+            template <typename Tout>
+            Tout par_reduce(const Tout& identity,
+                    std::function<Tout(const Tout& acc, const T& current)> function,
+                    std::function<Tout(const Tout&, const Tout&)> combine,
+                    size_t threads = 0, bool commutative = false)
+            {
+                auto plan = plan_parallel(threads, [&](const T& item) { function(identity, item); });
+
+                if (plan.threads == 1)
+                    return fold(identity, function);
+
+                threads = plan.threads;
+
+                auto parts = split_into(threads);
+
+                if (parts.size() == 1 && !commutative)
+                    return fold(identity, function);
+
+                std::vector<CachePadded<Tout>> partials(parts.size() > 1 ? parts.size() : threads, {identity});
+
+                if (parts.size() > 1)
+                {
+                    run_parallel(parts.size(), [&](size_t i) {
+                        Tout acc = identity;
+
+                        while (auto item = parts[i]->next())
+                            acc = function(acc, *item);
+
+                        partials[i].value = std::move(acc);
+                    });
+                }
+                else
+                {
+                    auto source = share(plan.grain);
+
+                    run_parallel(threads, [&](size_t i) {
+                        Tout acc = identity;
+                        auto worker = source->worker();
+
+                        while (auto item = worker->next())
+                            acc = function(acc, *item);
+
+                        partials[i].value = std::move(acc);
+                    });
+                }
+
+                for (size_t step = 1; step < partials.size(); step *= 2)
+                {
+                    for (size_t i = 0; i + step < partials.size(); i += 2 * step)
+                        partials[i].value = combine(partials[i].value, partials[i + step].value);
+                }
+
+                return partials[0].value;
+            }
+
+            bool eq(IIterator<T>::Ptr other)
+            {
+                T* fst = nullptr;
+                T* snd = nullptr;
+
+                while (true)
+                {
+                    fst = next();
+                    snd = other->next();
+
+                    if (!fst && snd)
+                        return false;
+                    else if (fst && !snd)
+                        return false;
+                    else if (!fst && !snd)
+                        return true;
+                    else if (*fst != *snd)
+                        return false;
+                    else
+                        continue;
+                }
+            }
+            
+            bool ne(IIterator<T>::Ptr other)
+            {
+                T* fst = nullptr;
+                T* snd = nullptr;
+
+                while (true)
+                {
+                    fst = next();
+                    snd = other->next();
+
+                    if (!fst && snd)
+                        return true;
+                    else if (fst && !snd)
+                        return true;
+                    else if (!fst && !snd)
+                        return true;
+                    else if (*fst == *snd)
+                        return false;
+                    else
+                        continue;
+                }
+            }
+    };
+
+    template <typename Container>
+    class Iter : public IIterator<typename Container::value_type>
+    {
+        protected:
+            typename Container::iterator _begin;
+            typename Container::iterator _end;
+
+            template <typename... Containers>
+            friend class ZipIndexed;
+
+        public:
+            using container_type = Container;
+
+            static constexpr bool is_random_access = std::is_base_of<std::random_access_iterator_tag,
+                  typename std::iterator_traits<typename Container::iterator>::iterator_category>::value;
+
+            Iter(const Iter& other) = default;
+            Iter(Container& cont)
+                : _begin(std::begin(cont))
+                , _end(std::end(cont))
+            {
+            }
+
+            typename Container::value_type* next() override
+            {
+                if (_begin == _end)
+                {
+                    return nullptr;
+                }
+                else
+                {
+                    auto& res = *_begin;
+                    _begin++;
+                    return &res;
+                }
+            }
+
+            std::pair<size_t, std::optional<size_t>> size_hint() override
+            {
+                if constexpr (is_random_access)
+                {
+                    auto len = size_t(_end - _begin);
+                    return {len, len};
+                }
+                else
+                {
+                    return {0, {}};
+                }
+            }
+
+            typename IIterator<typename Container::value_type>::Ptr slice(size_t from, size_t to) override
+            {
+                if constexpr (is_random_access)
+                {
+                    auto len = size_t(_end - _begin);
+                    auto part = std::make_shared<Iter<Container>>(*this);
+                    part->_begin = _begin + std::min(from, len);
+                    part->_end = _begin + std::max(std::min(to, len), std::min(from, len));
+                    return part;
+                }
+                else
+                {
+                    return nullptr;
+                }
+            }
+
+            // Random-access containers split in the middle, like slice()
+            typename IIterator<typename Container::value_type>::Ptr split() override
+            {
+                if constexpr (is_random_access)
+                {
+                    auto len = size_t(_end - _begin);
+
+                    if (len < 2)
+                        return nullptr;
+
+                    auto back = slice(len / 2, len);
+                    _end = _begin + len / 2;
+                    return back;
+                }
+                else
+                {
+                    return nullptr;
+                }
+            }
+
+            const typename Container::value_type* contiguous(size_t& len) override
+            {
+                if constexpr (is_random_access && has_data<Container>::value)
+                {
+                    len = size_t(_end - _begin);
+                    return len ? std::addressof(*_begin) : nullptr;
+                }
+                else
+                {
+                    return nullptr;
+                }
+            }
+
+            size_t advance_by(size_t n) override
+            {
+                if constexpr (is_random_access)
+                {
+                    n = std::min(n, size_t(_end - _begin));
+                    _begin += n;
+                    return n;
+                }
+                else
+                {
+                    size_t i = 0;
+
+                    for (; i < n && _begin != _end; i++)
+                        _begin++;
+
+                    return i;
+                }
+            }
+
+            typename IIterator<typename Container::value_type>::Ptr clone() override
+            {
+                return std::make_shared<Iter<Container>>(*this);
+            }
+    };
+    
+    template <typename T>
+    class Generator : public IIterator<T>
+    {
+        protected:
+            T _current;
+            SharedFunction<void(T&)> _increment;
+            bool _first;
+
+        public:
+            Generator(const Generator& other) = default;
+            Generator(const T& start, std::function<void(T&)> increment)
+                : _current(start)
+                , _increment(increment)
+                , _first(true)
+            {
+            }
+
+            T* next() override
+            {
+                if (_first)
+                {
+                    _first = false;
+                    return &_current;
+                }
+                else
+                {
+                    _increment(_current);
+                    return &_current;
+                }
+            }            
+
+            bool infinite() override
+            {
+                return true;
+            }
+            
+            typename IIterator<T>::Ptr clone() override
+            {
+                return std::make_shared<Generator<T>>(*this);
+            }
+
+    };
+
+    template <typename T>
+    class Range : public IIterator<T>
+    {
+        // At least unsigned int wide, so small types don't promote to int
+        using Unsigned = std::make_unsigned_t<std::common_type_t<T, unsigned>>;
+
+        protected:
+            T _front;
+            T _step;
+            size_t _len;
+            T _current;
+
+            // Value at offset i from the front, in modular arithmetic so
+            // intermediate results can't overflow a signed T
+            T at(size_t i) const
+            {
+                return T(Unsigned(_front) + Unsigned(i) * Unsigned(_step));
+            }
+
+        public:
+            Range(const Range& other) = default;
+            Range(const T& start, const T& step, const T& end)
+                : _front(start)
+                , _step(step)
+                , _len(0)
+                , _current(start)
+            {
+                static_assert(is_range_type<T>, "Range requires an integral type");
+
+                // A non-positive step would never reach end
+                if (step <= 0 && start < end)
+                    throw std::invalid_argument("gen: step must be positive to reach end");
+
+                if (start < end)
+                {
+                    auto span = size_t(Unsigned(end) - Unsigned(start));
+                    auto ustep = size_t(step);
+                    _len = span / ustep + (span % ustep != 0);
+                }
+            }
+
+            T* next() override
+            {
+                if (_len == 0)
+                    return nullptr;
+
+                _current = _front;
+                _front = at(1);
+                _len--;
+                return &_current;
+            }
+
+            T* next_back()
+            {
+                if (_len == 0)
+                    return nullptr;
+
+                _len--;
+                _current = at(_len);
+                return &_current;
+            }
+
+            std::pair<size_t, std::optional<size_t>> size_hint() override
+            {
+                return {_len, _len};
+            }
+
+            typename IIterator<T>::Ptr split() override
+            {
+                if (_len < 2)
+                    return nullptr;
+
+                auto mid = _len / 2;
+                auto back = std::make_shared<Range<T>>(*this);
+                back->_front = at(mid);
+                back->_len = _len - mid;
+                _len = mid;
+                return back;
+            }
+
+            typename IIterator<T>::Ptr slice(size_t from, size_t to) override
+            {
+                from = std::min(from, _len);
+                auto part = std::make_shared<Range<T>>(*this);
+                part->_front = at(from);
+                part->_len = std::max(std::min(to, _len), from) - from;
+                return part;
+            }
+
+            size_t advance_by(size_t n) override
+            {
+                n = std::min(n, _len);
+                _front = at(n);
+                _len -= n;
+                return n;
+            }
+
+            // Closed form of front + (front + step) + ... over the remaining
+            // items, wrapping like the sequential sum would
+            T sum()
+            {
+                Unsigned n = Unsigned(_len);
+                Unsigned triangle = _len % 2 == 0
+                    ? Unsigned(_len / 2) * Unsigned(_len - 1)
+                    : Unsigned(_len) * Unsigned((_len - 1) / 2);
+                auto res = T(n * Unsigned(_front) + triangle * Unsigned(_step));
+                advance_by(_len);
+                return res;
+            }
+
+            auto rev()
+            {
+                return std::make_shared<Rev<T, Range<T>>>(std::static_pointer_cast<Range<T>>(this->shared_from_this()));
+            }
+
+            typename IIterator<T>::Ptr clone() override
+            {
+                return std::make_shared<Range<T>>(*this);
+            }
+    };
+
+    template <typename T>
+    class Empty : public IIterator<T>
+    {
+        public:
+            Empty(const Empty& other) = default;
+            Empty()
+            {
+            }
+
+            T* next() override
+            {
+                return nullptr;
+            }
+
+            std::pair<size_t, std::optional<size_t>> size_hint() override
+            {
+                return {0, 0};
+            }
+
+            typename IIterator<T>::Ptr clone() override
+            {
+                return std::make_shared<Empty<T>>(*this);
+            }
+    };
+
+    template <typename T>
+    class Once : public IIterator<T>
+    {
+        T _value;
+        bool _emitted;
+
+        public:
+            Once(const Once& other) = default;
+            Once(const T& value)
+                : _value(value)
+                , _emitted(false)
+            {
+            }
+
+            T* next() override
+            {
+                if (!_emitted)
+                {
+                    _emitted = true;
+                    return &_value;
+                }
+                else
+                {
+                    return nullptr;
+                }
+            }
+
+            std::pair<size_t, std::optional<size_t>> size_hint() override
+            {
+                size_t len = _emitted ? 0 : 1;
+                return {len, len};
+            }
+
+            size_t advance_by(size_t n) override
+            {
+                if (n == 0 || _emitted)
+                    return 0;
+
+                _emitted = true;
+                return 1;
+            }
+
+            T* repeated_value() override
+            {
+                return _emitted ? nullptr : &_value;
+            }
+
+            typename IIterator<T>::Ptr clone() override
+            {
+                return std::make_shared<Once<T>>(*this);
+            }
+    };
+
+    template <typename T>
+    class Repeat : public IIterator<T>
+    {
+        T _value;
+
+        public:
+            Repeat(const Repeat& other) = default;
+            Repeat(const T& value)
+                : _value(value)
+            {
+            }
+
+            T* next() override
+            {
+                return &_value;
+            }
+
+            std::pair<size_t, std::optional<size_t>> size_hint() override
+            {
+                return {1, {}};
+            }
+
+            bool infinite() override
+            {
+                return true;
+            }
+
+            size_t advance_by(size_t n) override
+            {
+                return n;
+            }
+
+            T* repeated_value() override
+            {
+                return &_value;
+            }
+
+            typename IIterator<T>::Ptr clone() override
+            {
+                return std::make_shared<Repeat<T>>(*this);
+            }
+    };
+
+    // Read-only mapping of a whole file, shared by LinesInFile clones.
+    // Only regular files of nonzero size are mapped; data() is nullptr
+    // for anything else, such as pipes or files under /proc.
+    class FileMapping
+    {
+        const char* _data;
+        size_t _size;
+
+      public:
+        FileMapping(const FileMapping& other) = delete;
+        FileMapping& operator=(const FileMapping& other) = delete;
+
+        FileMapping(const fs::path& path)
+            : _data(nullptr)
+            , _size(0)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY);
+
+            if (fd < 0)
+                return;
+
+            struct stat st;
+
+            if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            {
+                void* data = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+                if (data != MAP_FAILED)
+                {
+                    _data = static_cast<const char*>(data);
+                    _size = size_t(st.st_size);
+                }
+            }
+
+            ::close(fd);
+        }
+
+        ~FileMapping()
+        {
+            if (_data)
+                ::munmap(const_cast<char*>(_data), _size);
+        }
+
+        const char* data() const
+        {
+            return _data;
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+    };
+
+    // Reads lines from the shared mapping of a regular file, or through
+    // a stream when the file can't be mapped (pipes, /proc, empty files)
+    class LinesInFile : public IIterator<std::string>
+    {
+        fs::path _path;
+        std::shared_ptr<const FileMapping> _file;
+        std::shared_ptr<std::ifstream> _stream;
+        size_t _pos;
+        size_t _end;
+        std::string _currentLine;
+
+      public:
+        LinesInFile(const LinesInFile& other) = default;
+        LinesInFile(const fs::path& path)
+            : _path(path)
+            , _file(std::make_shared<const FileMapping>(path))
+            , _pos(0)
+            , _end(_file->size())
+        {
+            if (!_file->data())
+                _stream = std::make_shared<std::ifstream>(path);
+        }
+
+        std::string* next() override
+        {
+            if (_stream)
+            {
+                if (std::getline(*_stream, _currentLine))
+                    return &_currentLine;
+                else
+                    return nullptr;
+            }
+
+            if (_pos >= _end)
+                return nullptr;
+
+            auto begin = _file->data() + _pos;
+            auto newline = static_cast<const char*>(std::memchr(begin, '\n', _end - _pos));
+            auto len = newline ? size_t(newline - begin) : _end - _pos;
+
+            _currentLine.assign(begin, len);
+            _pos += newline ? len + 1 : len;
+            return &_currentLine;
+        }
+
+        // Splits at the first line break past the middle of what's left,
+        // so both halves read whole lines from the shared mapping
+        typename IIterator<std::string>::Ptr split() override
+        {
+            if (_stream || _end - _pos < 2)
+                return nullptr;
+
+            auto mid = _pos + (_end - _pos) / 2;
+            auto newline = static_cast<const char*>(std::memchr(_file->data() + mid, '\n', _end - mid));
+
+            if (!newline)
+                return nullptr;
+
+            auto cut = size_t(newline - _file->data()) + 1;
+
+            if (cut >= _end)
+                return nullptr;
+
+            auto back = std::make_shared<LinesInFile>(*this);
+            back->_pos = cut;
+            _end = cut;
+            return back;
+        }
+
+        // Clones share the mapping and copy the cursor. A stream can't
+        // be rewound, so a clone of one reopens the file from the start.
+        typename IIterator<std::string>::Ptr clone() override
+        {
+            if (_stream)
+                return std::make_shared<LinesInFile>(_path);
+
+            return std::make_shared<LinesInFile>(*this);
+        }
+    };
+
+    template <typename T>
+    class Take : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        int _count;
+
+      public:
+        Take(const Take& other) = default;
+        Take(typename IIterator<T>::Ptr iter, int count) 
+            : _iter(iter)
+            , _count(count)
+        {
+        }
+
+        T* next() override
+        {
+            if (_count > 0)
+            if (auto item = _iter->next())
+            {
+                _count--;
+                return item;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            if (_count <= 0)
+                return {0, 0};
+
+            auto [lower, upper] = _iter->size_hint();
+            auto count = size_t(_count);
+
+            if (_iter->infinite())
+                return {count, count};
+
+            return {std::min(lower, count), upper ? std::min(*upper, count) : count};
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            if (_count <= 0)
+                return 0;
+
+            auto skipped = _iter->advance_by(std::min(n, size_t(_count)));
+            _count -= skipped;
+            return skipped;
+        }
+
+        T* repeated_value() override
+        {
+            return _count > 0 ? _iter->repeated_value() : nullptr;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Take<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class TakeWhile : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        SharedFunction<bool(const T&)> _pred;
+        bool _done;
+
+      public:
+        TakeWhile(const TakeWhile& other) = default;
+        TakeWhile(typename IIterator<T>::Ptr iter, std::function<bool(const T&)> pred) 
+            : _iter(iter)
+            , _pred(pred)
+            , _done(false)
+        {
+        }
+
+        T* next() override
+        {
+            while (auto item = _iter->next())
+            {
+                if (!_done && _pred(*item))
+                {
+                    return item;
+                }
+                else
+                {
+                    _done = false;
+                    return nullptr;
+                }
+            }
+
+            return nullptr;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<TakeWhile<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Skip : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        int _current;
+        int _count;
+
+      public:
+        Skip(const Skip& other) = default;
+        Skip(typename IIterator<T>::Ptr iter, int count) 
+            : _iter(iter)
+            , _current(0)
+            , _count(count)
+        {
+        }
+
+        // Pending items are skipped with advance_by(), in O(1) for
+        // sources that know their layout
+        T* next() override
+        {
+            if (_current < _count)
+            {
+                _current += int(_iter->advance_by(size_t(_count - _current)));
+
+                if (_current < _count)
+                    return nullptr;
+            }
+
+            return _iter->next();
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            auto [lower, upper] = _iter->size_hint();
+            auto pending = size_t(std::max(_count - _current, 0));
+            auto sub = [=](size_t n) { return n > pending ? n - pending : 0; };
+
+            if (upper)
+                return {sub(lower), sub(*upper)};
+            else
+                return {sub(lower), {}};
+        }
+
+        bool infinite() override
+        {
+            return _iter->infinite();
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            if (_current < _count)
+            {
+                auto pending = size_t(_count - _current);
+                auto skipped = _iter->advance_by(pending);
+                _current += int(skipped);
+
+                if (skipped < pending)
+                    return 0;
+            }
+
+            return _iter->advance_by(n);
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Skip<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class SkipWhile : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        SharedFunction<bool(const T&)> _pred;
+        bool _done;
+
+      public:
+        SkipWhile(const SkipWhile& other) = default;
+        SkipWhile(typename IIterator<T>::Ptr iter, std::function<bool(const T&)> pred) 
+            : _iter(iter)
+            , _pred(pred)
+            , _done(false)
+        {
+        }
+
+        T* next() override
+        {
+            while (auto item = _iter->next())
+            {
+                if (!_done)
+                {
+                    if (_pred(*item))
+                    {
+                        continue;
+                    }
+                    else
+                    {
+                        _done = true;
+                        return item;
+                    }
+                }
+                else
+                {
+                    return item;
+                }
+            }
+
+            return nullptr;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<SkipWhile<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Filter : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        SharedFunction<bool(const T&)> _predicate;
+
+      public:
+        Filter(const Filter& other) = default;
+        Filter(typename IIterator<T>::Ptr iter, std::function<bool(const T&)>  predicate)
+            : _iter(iter)
+            , _predicate(predicate)
+        {
+        }
+
+        T* next() override
+        {
+            while(auto item = _iter->next())
+                if (_predicate(*item))
+                    return item;
+
+            return nullptr;
+        }
+
+        typename IIterator<T>::Ptr split() override
+        {
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            auto copy = std::make_shared<Filter<T>>(*this);
+            copy->_iter = back;
+            return copy;
+        }
+
+        bool fusion_parts(typename IIterator<T>::Ptr& source, std::vector<Stage<T>>& stages) override
+        {
+            source = _iter;
+            stages = {{StageKind::filter, _predicate, {}, {}}};
+            return true;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Filter<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class BatchFilter : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        Comparison<T> _comparison;
+        std::vector<T> _in;
+        std::vector<T> _out;
+        size_t _count;
+        size_t _pos;
+
+        static constexpr size_t batchSize = 1024;
+
+        // Compresses the next batch of upstream items into _out. Reads the
+        // upstream storage in place when it's contiguous.
+        bool refill()
+        {
+            _out.resize(batchSize);
+            _count = 0;
+            _pos = 0;
+
+            size_t len = 0;
+            const T* data = _iter->contiguous(len);
+
+            if (data)
+            {
+                len = std::min(len, batchSize);
+                _count = compress(data, len, _out.data(), _comparison);
+                _iter->advance_by(len);
+                return len > 0;
+            }
+
+            _in.clear();
+
+            while (_in.size() < batchSize)
+            {
+                auto item = _iter->next();
+
+                if (!item)
+                    break;
+
+                _in.push_back(*item);
+            }
+
+            _count = compress(_in.data(), _in.size(), _out.data(), _comparison);
+            return !_in.empty();
+        }
+
+      public:
+        BatchFilter(const BatchFilter& other) = default;
+        BatchFilter(typename IIterator<T>::Ptr iter, const Comparison<T>& comparison)
+            : _iter(iter)
+            , _comparison(comparison)
+            , _count(0)
+            , _pos(0)
+        {
+        }
+
+        T* next() override
+        {
+            while (_pos == _count)
+            {
+                if (!refill())
+                    return nullptr;
+            }
+
+            return &_out[_pos++];
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            auto buffered = _count - _pos;
+            auto upper = _iter->size_hint().second;
+
+            if (upper)
+                return {buffered, *upper + buffered};
+
+            return {buffered, {}};
+        }
+
+        typename IIterator<T>::Ptr split() override
+        {
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            return std::make_shared<BatchFilter<T>>(back, _comparison);
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<BatchFilter<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename Tin, typename Tout>
+    class Map : public IIterator<Tout>
+    {
+        typename IIterator<Tin>::Ptr _iter;
+        Tout _result;
+        SharedFunction<Tout(const Tin&)> _fun;
+
+      public:
+        Map(const Map& other) = default;
+        Map(typename IIterator<Tin>::Ptr iter, std::function<Tout(const Tin&)> fun)
+            : _iter(iter)
+            , _fun(fun)
+        {
+        }
+
+        Tout* next() override
+        {
+            if (auto item = _iter->next())
+            {
+                _result = _fun(*item);
+                return &_result;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return _iter->size_hint();
+        }
+
+        bool infinite() override
+        {
+            return _iter->infinite();
+        }
+
+        // Skipped items are never passed to the mapping function
+        size_t advance_by(size_t n) override
+        {
+            return _iter->advance_by(n);
+        }
+
+        typename IIterator<Tout>::Ptr split() override
+        {
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            auto copy = std::make_shared<Map<Tin,Tout>>(*this);
+            copy->_iter = back;
+            return copy;
+        }
+
+        typename IIterator<Tout>::Ptr slice(size_t from, size_t to) override
+        {
+            auto part = _iter->slice(from, to);
+
+            if (!part)
+                return nullptr;
+
+            auto copy = std::make_shared<Map<Tin,Tout>>(*this);
+            copy->_iter = part;
+            return copy;
+        }
+
+        bool fusion_parts(typename IIterator<Tout>::Ptr& source, std::vector<Stage<Tout>>& stages) override
+        {
+            if constexpr (std::is_same<Tin, Tout>::value)
+            {
+                source = _iter;
+                stages = {{StageKind::map, {}, _fun, {}}};
+                return true;
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        typename IIterator<Tout>::Ptr fused_with(const Stage<Tout>& stage) override
+        {
+            if constexpr (std::is_same<Tin, Tout>::value)
+                return IIterator<Tout>::fused_with(stage);
+            else
+                return std::make_shared<Fused<Tin, Tout>>(_iter, std::vector<Stage<Tin>>(), _fun,
+                                                          std::vector<Stage<Tout>>{stage});
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Map<Tin,Tout>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Inspect : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        SharedFunction<void(const T&)> _fun;
+
+      public:
+        Inspect(const Inspect& other) = default;
+        Inspect(typename IIterator<T>::Ptr iter, std::function<void(const T&)> fun)
+            : _iter(iter)
+            , _fun(fun)
+        {
+        }
+
+        T* next() override
+        {
+            if (auto item = _iter->next())
+            {
+                _fun(*item);
+                return item;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return _iter->size_hint();
+        }
+
+        bool infinite() override
+        {
+            return _iter->infinite();
+        }
+
+        typename IIterator<T>::Ptr split() override
+        {
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            auto copy = std::make_shared<Inspect<T>>(*this);
+            copy->_iter = back;
+            return copy;
+        }
+
+        bool fusion_parts(typename IIterator<T>::Ptr& source, std::vector<Stage<T>>& stages) override
+        {
+            source = _iter;
+            stages = {{StageKind::inspect, {}, {}, _fun}};
+            return true;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Inspect<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    // Source, then stages over Tin, then an optional Tin -> Tout mapping
+    // (the only place the item type changes), then stages over Tout.
+    // Replaces a chain of Filter/Map/Inspect nodes with one virtual hop.
+    template <typename Tin, typename Tout>
+    class Fused : public IIterator<Tout>
+    {
+        static constexpr bool maps_type = !std::is_same<Tin, Tout>::value;
+
+        typename IIterator<Tin>::Ptr _iter;
+        std::vector<Stage<Tin>> _before;
+        SharedFunction<Tout(const Tin&)> _fun;
+        std::vector<Stage<Tout>> _after;
+        std::optional<Tin> _inResult;
+        std::optional<Tout> _result;
+
+        template <typename T>
+        static T* run(const std::vector<Stage<T>>& stages, T* item, std::optional<T>& result)
+        {
+            for (auto& stage : stages)
+            {
+                switch (stage.kind)
+                {
+                    case StageKind::filter:
+                        if (!stage.predicate(*item))
+                            return nullptr;
+                        break;
+
+                    case StageKind::map:
+                    {
+                        // item may point into result, so compute before replacing it
+                        T value = stage.function(*item);
+                        result.emplace(std::move(value));
+                        item = &*result;
+                        break;
+                    }
+
+                    case StageKind::inspect:
+                        stage.inspector(*item);
+                        break;
+                }
+            }
+
+            return item;
+        }
+
+        bool filters() const
+        {
+            auto isFilter = [](auto& stage) { return stage.kind == StageKind::filter; };
+            return std::any_of(_before.begin(), _before.end(), isFilter)
+                || std::any_of(_after.begin(), _after.end(), isFilter);
+        }
+
+      public:
+        Fused(const Fused& other) = default;
+        Fused(typename IIterator<Tin>::Ptr iter,
+              std::vector<Stage<Tin>> before,
+              SharedFunction<Tout(const Tin&)> fun = {},
+              std::vector<Stage<Tout>> after = {})
+            : _iter(iter)
+            , _before(std::move(before))
+            , _fun(fun)
+            , _after(std::move(after))
+        {
+        }
+
+        Tout* next() override
+        {
+            while (auto item = _iter->next())
+            {
+                auto in = run(_before, item, _inResult);
+
+                if (!in)
+                    continue;
+
+                if constexpr (maps_type)
+                {
+                    Tout value = _fun(*in);
+                    _result.emplace(std::move(value));
+
+                    if (auto out = run(_after, &*_result, _result))
+                        return out;
+                }
+                else
+                {
+                    return in;
+                }
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            auto [lower, upper] = _iter->size_hint();
+            return {filters() ? 0 : lower, upper};
+        }
+
+        bool infinite() override
+        {
+            return !filters() && _iter->infinite();
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            auto stateless = [](auto& stage) { return stage.kind == StageKind::map; };
+
+            if (std::all_of(_before.begin(), _before.end(), stateless)
+                && std::all_of(_after.begin(), _after.end(), stateless))
+                return _iter->advance_by(n);
+
+            return IIterator<Tout>::advance_by(n);
+        }
+
+        typename IIterator<Tout>::Ptr split() override
+        {
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            auto copy = std::make_shared<Fused<Tin, Tout>>(*this);
+            copy->_iter = back;
+            return copy;
+        }
+
+        // Filter stages change positions, so only filterless chains slice
+        typename IIterator<Tout>::Ptr slice(size_t from, size_t to) override
+        {
+            if (filters())
+                return nullptr;
+
+            auto part = _iter->slice(from, to);
+
+            if (!part)
+                return nullptr;
+
+            auto copy = std::make_shared<Fused<Tin, Tout>>(*this);
+            copy->_iter = part;
+            return copy;
+        }
+
+        bool fusion_parts(typename IIterator<Tout>::Ptr& source, std::vector<Stage<Tout>>& stages) override
+        {
+            if constexpr (maps_type)
+            {
+                return false;
+            }
+            else
+            {
+                source = _iter;
+                stages = _before;
+                return true;
+            }
+        }
+
+        typename IIterator<Tout>::Ptr fused_with(const Stage<Tout>& stage) override
+        {
+            if constexpr (maps_type)
+            {
+                auto fused = std::make_shared<Fused<Tin, Tout>>(*this);
+                fused->_after.push_back(stage);
+                return fused;
+            }
+            else
+            {
+                return IIterator<Tout>::fused_with(stage);
+            }
+        }
+
+        // Fused stages in pipeline order, e.g. "filter -> map -> filter"
+        std::string stages() const
+        {
+            std::string res;
+
+            auto append = [&](const char* name)
+            {
+                if (!res.empty())
+                    res += " -> ";
+                res += name;
+            };
+
+            for (auto& stage : _before)
+                append(stage.name());
+
+            if (maps_type)
+                append("map");
+
+            for (auto& stage : _after)
+                append(stage.name());
+
+            return res;
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Fused<Tin, Tout>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename Tin, typename Tout>
+    class FilterMap : public IIterator<Tout>
+    {
+        typename IIterator<Tin>::Ptr _iter;
+        Tout _result;
+        SharedFunction<std::optional<Tout>(const Tin&)> _fun;
+
+      public:
+        FilterMap(const FilterMap& other) = default;
+        FilterMap(typename IIterator<Tin>::Ptr iter, std::function<std::optional<Tout>(const Tin&)> fun)
+            : _iter(iter)
+            , _fun(fun)
+        {
+        }
+
+        Tout* next() override
+        {
+            while (auto item = _iter->next())
+            {
+                if (auto res = _fun(*item))
+                {
+                    _result = *res;
+                    return &_result;
+                }
+            }
+
+            return nullptr;
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<FilterMap<Tin,Tout>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename Tin, typename Tout>
+    class FlatMap : public IIterator<Tout>
+    {
+        typename IIterator<Tin>::Ptr _iter;
+        Tout _result;
+        SharedFunction<typename IIterator<Tout>::Ptr (const Tin&)> _fun;
+        typename IIterator<Tout>::Ptr _iterOut;
+
+      public:
+        FlatMap(const FlatMap& other) = default;
+        FlatMap(typename IIterator<Tin>::Ptr iter,
+                std::function<typename IIterator<Tout>::Ptr(const Tin&)> fun)
+            : _iter(iter)
+            , _fun(fun)
+            , _iterOut(empty<Tout>())
+        {
+        }
+
+        Tout* next() override
+        {
+            while (true)
+            {
+                if (auto item = _iterOut->next())
+                    return item;
+
+                auto in = _iter->next();
+
+                if (!in)
+                    return nullptr;
+
+                // nullptr is an empty expansion
+                if (!(_iterOut = _fun(*in)))
+                    _iterOut = empty<Tout>();
+            }
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<FlatMap<Tin,Tout>>(*this);
+            copy->_iter = _iter->clone();
+            copy->_iterOut = _iterOut->clone();
+            return copy;
+        }
+    };
+
+    template <typename Tin, typename Tout>
+    class FlatMapInto : public IIterator<Tout>
+    {
+        typename IIterator<Tin>::Ptr _iter;
+        SharedFunction<void(const Tin&, std::vector<Tout>&)> _fun;
+        std::vector<Tout> _buffer;
+        size_t _pos;
+
+      public:
+        FlatMapInto(const FlatMapInto& other) = default;
+        FlatMapInto(typename IIterator<Tin>::Ptr iter,
+                    std::function<void(const Tin&, std::vector<Tout>&)> fun)
+            : _iter(iter)
+            , _fun(fun)
+            , _pos(0)
+        {
+        }
+
+        Tout* next() override
+        {
+            while (_pos == _buffer.size())
+            {
+                auto in = _iter->next();
+
+                if (!in)
+                    return nullptr;
+
+                _buffer.clear();
+                _pos = 0;
+                _fun(*in, _buffer);
+            }
+
+            return &_buffer[_pos++];
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return {_buffer.size() - _pos, {}};
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<FlatMapInto<Tin,Tout>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename Tfirst, typename Tsecond>
+    class Zip : public IIterator<std::pair<Tfirst, Tsecond> >
+    {
+        typename IIterator<Tfirst>::Ptr _iter1;
+        typename IIterator<Tsecond>::Ptr _iter2;
+
+        using Pair = std::pair<Tfirst, Tsecond>;
+        Pair _result;
+
+      public:
+        Zip(const Zip& other) = default;
+        Zip(typename IIterator<Tfirst>::Ptr iter1, typename IIterator<Tsecond>::Ptr iter2)
+            : _iter1(iter1)
+            , _iter2(iter2)
+        {
+        }
+
+        std::pair<Tfirst, Tsecond>* next() override
+        { 
+            if (auto item1 = _iter1->next())
+            if (auto item2 = _iter2->next())
+            {
+                _result = std::make_pair(*item1, *item2);
+                return &_result;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            if (_iter1->infinite())
+                return _iter2->size_hint();
+
+            if (_iter2->infinite())
+                return _iter1->size_hint();
+
+            auto [lower1, upper1] = _iter1->size_hint();
+            auto [lower2, upper2] = _iter2->size_hint();
+            auto lower = std::min(lower1, lower2);
+
+            if (upper1 && upper2)
+                return {lower, std::min(*upper1, *upper2)};
+            else if (upper1)
+                return {lower, upper1};
+            else
+                return {lower, upper2};
+        }
+
+        bool infinite() override
+        {
+            return _iter1->infinite() && _iter2->infinite();
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            auto skipped1 = _iter1->advance_by(n);
+            auto skipped2 = _iter2->advance_by(n);
+            return std::min(skipped1, skipped2);
+        }
+
+        typename IIterator<std::pair<Tfirst, Tsecond>>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Zip<Tfirst, Tsecond>>(*this);
+            copy->_iter1 = _iter1->clone();
+            copy->_iter2 = _iter2->clone();
+            return copy;
+        }
+    };
+
+    template <typename... Ts>
+    class ZipN : public IIterator<std::tuple<Ts&...>>
+    {
+        std::tuple<typename IIterator<Ts>::Ptr...> _iters;
+        std::optional<std::tuple<Ts&...>> _result;
+
+        template <size_t... I>
+        std::tuple<Ts&...>* next(std::index_sequence<I...>)
+        {
+            std::tuple<Ts*...> items;
+
+            if (!((std::get<I>(items) = std::get<I>(_iters)->next()) && ...))
+                return nullptr;
+
+            _result.emplace(*std::get<I>(items)...);
+            return &*_result;
+        }
+
+      public:
+        ZipN(const ZipN& other) = default;
+        ZipN(typename IIterator<Ts>::Ptr... iters)
+            : _iters(iters...)
+        {
+        }
+
+        std::tuple<Ts&...>* next() override
+        {
+            return next(std::index_sequence_for<Ts...>());
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            std::optional<size_t> lower;
+            std::optional<size_t> upper;
+
+            // Infinite iterators don't bound the length
+            auto bound = [&](auto& iter)
+            {
+                if (iter->infinite())
+                    return;
+
+                auto [l, u] = iter->size_hint();
+                lower = lower ? std::min(*lower, l) : l;
+
+                if (u)
+                    upper = upper ? std::min(*upper, *u) : *u;
+            };
+
+            std::apply([&](auto&... iters) { (bound(iters), ...); }, _iters);
+
+            return {lower.value_or(0), upper};
+        }
+
+        bool infinite() override
+        {
+            return std::apply([](auto&... iters) { return (iters->infinite() && ...); }, _iters);
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            return std::apply([&](auto&... iters) { return std::min({iters->advance_by(n)...}); }, _iters);
+        }
+
+        typename IIterator<std::tuple<Ts&...>>::Ptr clone() override
+        {
+            auto copy = std::make_shared<ZipN<Ts...>>(*this);
+            copy->_iters = std::apply([](auto&... iters) { return std::make_tuple(iters->clone()...); }, _iters);
+            return copy;
+        }
+    };
+
+    template <typename... Containers>
+    class ZipIndexed : public IIterator<std::tuple<typename Containers::value_type&...>>
+    {
+        using Tuple = std::tuple<typename Containers::value_type&...>;
+
+        std::tuple<typename Containers::iterator...> _begins;
+        size_t _pos;
+        size_t _end;
+        std::optional<Tuple> _result;
+
+      public:
+        ZipIndexed(const ZipIndexed& other) = default;
+        ZipIndexed(const Iter<Containers>&... iters)
+            : _begins(iters._begin...)
+            , _pos(0)
+            , _end(std::min({size_t(iters._end - iters._begin)...}))
+        {
+        }
+
+        Tuple* next() override
+        {
+            if (_pos == _end)
+                return nullptr;
+
+            std::apply([&](auto&... begins) { _result.emplace(begins[_pos]...); }, _begins);
+            _pos++;
+            return &*_result;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return {_end - _pos, _end - _pos};
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            n = std::min(n, _end - _pos);
+            _pos += n;
+            return n;
+        }
+
+        typename IIterator<Tuple>::Ptr split() override
+        {
+            if (_end - _pos < 2)
+                return nullptr;
+
+            auto back = std::make_shared<ZipIndexed<Containers...>>(*this);
+            back->_pos = _pos + (_end - _pos) / 2;
+            _end = back->_pos;
+            return back;
+        }
+
+        typename IIterator<Tuple>::Ptr clone() override
+        {
+            return std::make_shared<ZipIndexed<Containers...>>(*this);
+        }
+    };
+
+    template <typename T>
+    class Enumerate : public IIterator<std::pair<size_t, T&>>
+    {
+        using Pair = std::pair<size_t, T&>;
+
+        typename IIterator<T>::Ptr _iter;
+        size_t _count;
+        std::optional<Pair> _result;
+
+      public:
+        Enumerate(const Enumerate& other) = default;
+        Enumerate(typename IIterator<T>::Ptr iter)
+            : _iter(iter)
+            , _count(0)
+        {
+        }
+
+        Pair* next() override
+        {
+            if (auto item = _iter->next())
+            {
+                _result.emplace(_count++, *item);
+                return &*_result;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return _iter->size_hint();
+        }
+
+        bool infinite() override
+        {
+            return _iter->infinite();
+        }
+
+        size_t advance_by(size_t n) override
+        {
+            auto skipped = _iter->advance_by(n);
+            _count += skipped;
+            return skipped;
+        }
+
+        // The back part's indices start after the front part, which needs
+        // an upstream of known length
+        typename IIterator<Pair>::Ptr split() override
+        {
+            size_t len;
+
+            if (!_iter->exact_size(len))
+                return nullptr;
+
+            auto back = _iter->split();
+
+            if (!back)
+                return nullptr;
+
+            auto copy = std::make_shared<Enumerate<T>>(*this);
+            copy->_iter = back;
+            copy->_count = _count + _iter->size_hint().first;
+            return copy;
+        }
+
+        typename IIterator<Pair>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Enumerate<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Chain : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter1;
+        typename IIterator<T>::Ptr _iter2;
+        bool _consumedFirst;
+
+      public:
+        Chain(const Chain& other) = default;
+        Chain(typename IIterator<T>::Ptr iter1, typename IIterator<T>::Ptr iter2)
+            : _iter1(iter1)
+            , _iter2(iter2)
+            , _consumedFirst(false)
+        {
+        }
+
+        T* next() override
+        { 
+            if (!_consumedFirst)
+            {
+                if (auto item1 = _iter1->next())
+                    return item1;
+                else
+                    _consumedFirst = true;
+            }
+
+            if (_consumedFirst)
+            {
+                if (auto item2 = _iter2->next())
+                    return item2;
+            }
+
+            return nullptr;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            auto [lower2, upper2] = _iter2->size_hint();
+
+            if (_consumedFirst)
+                return {lower2, upper2};
+
+            auto [lower1, upper1] = _iter1->size_hint();
+            auto lower = lower1 > SIZE_MAX - lower2 ? SIZE_MAX : lower1 + lower2;
+
+            if (upper1 && upper2 && *upper1 <= SIZE_MAX - *upper2)
+                return {lower, *upper1 + *upper2};
+            else
+                return {lower, {}};
+        }
+
+        bool infinite() override
+        {
+            return (!_consumedFirst && _iter1->infinite()) || _iter2->infinite();
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Chain<T>>(*this);
+            copy->_iter1 = _iter1->clone();
+            copy->_iter2 = _iter2->clone();
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Cycle : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iterOrig;
+        typename IIterator<T>::Ptr _iter;
+        // Shared with clones, copied before a clone writes to it
+        std::shared_ptr<std::vector<T>> _buffer;
+        size_t _capacity;
+        size_t _replay;
+        bool _recording;
+
+        T* replay()
+        {
+            if (_buffer->empty())
+                return nullptr;
+
+            if (_replay == _buffer->size())
+                _replay = 0;
+
+            return &(*_buffer)[_replay++];
+        }
+
+        void record(const T& item)
+        {
+            if (_buffer.use_count() > 1)
+                _buffer = std::make_shared<std::vector<T>>(*_buffer);
+
+            _buffer->push_back(item);
+        }
+
+      public:
+        Cycle(const Cycle& other) = default;
+        Cycle(typename IIterator<T>::Ptr iter, size_t bufferCapacity = 0)
+            : _iterOrig(iter)
+            , _iter(iter->clone())
+            , _buffer(std::make_shared<std::vector<T>>())
+            , _capacity(bufferCapacity)
+            , _replay(0)
+            , _recording(bufferCapacity > 0)
+        {
+        }
+
+        T* next() override
+        { 
+            if (!_iter)
+                return replay();
+
+            // A fresh pass that yields nothing means the source is empty
+            for (int pass = 0; pass < 2; pass++)
+            {
+                if (auto item = _iter->next())
+                {
+                    if (_recording)
+                    {
+                        if (_buffer->size() < _capacity)
+                        {
+                            record(*item);
+                        }
+                        else
+                        {
+                            _recording = false;
+                            _buffer = std::make_shared<std::vector<T>>();
+                        }
+                    }
+
+                    return item;
+                }
+
+                if (_recording)
+                {
+                    _iter = nullptr;
+                    return replay();
+                }
+
+                _iter = _iterOrig->clone();
+            }
+
+            return nullptr;
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            // The original is never advanced, so clones can share it
+            auto copy = std::make_shared<Cycle<T>>(*this);
+
+            if (_iter)
+                copy->_iter = _iter->clone();
+
+            return copy;
+        }
+    };
+
+    template <typename T>
+    class Fuse : public IIterator<T>
+    {
+        typename IIterator<T>::Ptr _iter;
+        bool _done;
+
+      public:
+        Fuse(const Fuse& other) = default;
+        Fuse(typename IIterator<T>::Ptr iter)
+            : _iter(iter)
+            , _done(false)
+        {
+        }
+
+        T* next() override
+        { 
+            if (!_done)
+            {
+                if (auto item = _iter->next())
+                {
+                    return item;
+                }
+                else
+                {
+                    _done = true;
+                    return nullptr;
+                }
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            if (_done)
+                return {0, 0};
+
+            return _iter->size_hint();
+        }
+
+        bool infinite() override
+        {
+            return !_done && _iter->infinite();
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Fuse<T>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    template <typename T, typename Source>
+    class Rev : public IIterator<T>
+    {
+        std::shared_ptr<Source> _iter;
+
+      public:
+        Rev(const Rev& other) = default;
+        Rev(std::shared_ptr<Source> iter)
+            : _iter(iter)
+        {
+        }
+
+        T* next() override
+        {
+            return _iter->next_back();
+        }
+
+        T* next_back()
+        {
+            return _iter->next();
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            return _iter->size_hint();
+        }
+
+        bool infinite() override
+        {
+            return _iter->infinite();
+        }
+
+        typename IIterator<T>::Ptr clone() override
+        {
+            return std::make_shared<Rev<T, Source>>(std::static_pointer_cast<Source>(_iter->clone()));
+        }
+    };
+
+    template <typename Tin, typename Tout>
+    class Scan : public IIterator<Tout>
+    {
+        typename IIterator<Tin>::Ptr _iter;
+        Tout _result;
+        SharedFunction<Tout(const Tout&, const Tin&)> _fun;
+
+      public:
+        Scan(const Scan& other) = default;
+        Scan(typename IIterator<Tin>::Ptr iter,
+                const Tout& init,
+                std::function<Tout(const Tout&, const Tin&)> fun)
+            : _iter(iter)
+            , _result(init)
+            , _fun(fun)
+        {
+        }
+
+        Tout* next() override
+        {
+            if (auto item = _iter->next())
+            {
+                _result = _fun(_result, *item);
+                return &_result;
+            }
+
+            return nullptr;
+        }
+
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            auto copy = std::make_shared<Scan<Tin,Tout>>(*this);
+            copy->_iter = _iter->clone();
+            return copy;
+        }
+    };
+
+    // Bounded single-producer single-consumer ring of batches. Each index
+    // sits on its own cache line, and each side caches the other's index
+    // so it only touches the shared line when it looks full or empty.
+    template <typename T>
+    class SpscRing
+    {
+        static constexpr size_t cacheLine = 64;
+
+      public:
+        struct Batch
+        {
+            std::vector<T> items;
+            bool last = false;
+        };
+
+      private:
+        std::vector<Batch> _slots;
+
+        alignas(cacheLine) std::atomic<size_t> _head;
+        size_t _tailCache;
+        // Bumped after the head moves or the producer is interrupted;
+        // it's what a producer waiting for room waits on
+        std::atomic<uint32_t> _wakeups;
+
+        alignas(cacheLine) std::atomic<size_t> _tail;
+        size_t _headCache;
+
+      public:
+        SpscRing(size_t slots)
+            : _slots(std::max<size_t>(slots, 2))
+            , _head(0)
+            , _tailCache(0)
+            , _wakeups(0)
+            , _tail(0)
+            , _headCache(0)
+        {
+        }
+
+        // Producer: slot to fill next, or nullptr once stopped
+        Batch* acquire(const std::atomic<bool>& stop)
+        {
+            auto tail = _tail.load(std::memory_order_relaxed);
+
+            while (!stop.load(std::memory_order_acquire))
+            {
+                if (tail - _headCache < _slots.size())
+                    return &_slots[tail % _slots.size()];
+
+                // Read before head and stop, so a later change wakes us
+                auto wakeups = _wakeups.load(std::memory_order_acquire);
+                _headCache = _head.load(std::memory_order_acquire);
+
+                if (tail - _headCache < _slots.size())
+                    continue;
+
+                if (stop.load(std::memory_order_acquire))
+                    break;
+
+                wait_while_equal(_wakeups, wakeups);
+            }
+
+            return nullptr;
+        }
+
+        void publish()
+        {
+            _tail.fetch_add(1, std::memory_order_release);
+            notify_waiters(_tail);
+        }
+
+        // Consumer: oldest published batch, waiting for one if needed
+        Batch& front()
+        {
+            auto head = _head.load(std::memory_order_relaxed);
+
+            while (head == _tailCache)
+            {
+                wait_while_equal(_tail, _tailCache);
+                _tailCache = _tail.load(std::memory_order_acquire);
+            }
+
+            return _slots[head % _slots.size()];
+        }
+
+        void release()
+        {
+            _head.fetch_add(1, std::memory_order_release);
+            interrupt();
+        }
+
+        // Wakes a producer waiting for room, e.g. after setting its stop
+        // flag, without moving the head
+        void interrupt()
+        {
+            _wakeups.fetch_add(1, std::memory_order_release);
+            notify_waiters(_wakeups);
+        }
+    };
+
+    // Runs its upstream on a dedicated thread, handing items over in
+    // batches through an SpscRing. Dropping it stops the thread, which
+    // blocks until the upstream's current next() returns.
+    template <typename T>
+    class Staged : public IIterator<T>
+    {
+        struct Shared
+        {
+            typename IIterator<T>::Ptr iter;
+            SpscRing<T> ring;
+            size_t batchSize;
+            std::atomic<bool> stop;
+            std::exception_ptr error;
+
+            Shared(typename IIterator<T>::Ptr iter, size_t slots, size_t batchSize)
+                : iter(iter)
+                , ring(slots)
+                , batchSize(batchSize)
+                , stop(false)
+            {
+            }
+
+            void produce()
+            {
+                try
+                {
+                    while (auto batch = ring.acquire(stop))
+                    {
+                        batch->items.clear();
+
+                        while (batch->items.size() < batchSize)
+                        {
+                            auto item = iter->next();
+
+                            if (!item)
+                            {
+                                batch->last = true;
+                                break;
+                            }
+
+                            batch->items.push_back(*item);
+                        }
+
+                        bool last = batch->last;
+                        ring.publish();
+
+                        if (last)
+                            return;
+                    }
+                }
+                catch (...)
+                {
+                    error = std::current_exception();
+
+                    if (auto batch = ring.acquire(stop))
+                    {
+                        batch->items.clear();
+                        batch->last = true;
+                        ring.publish();
+                    }
+                }
+            }
+        };
+
+        typename IIterator<T>::Ptr _iter;
+        size_t _capacity;
+        size_t _batchSize;
+        std::shared_ptr<Shared> _shared;
+        std::thread _thread;
+        typename SpscRing<T>::Batch* _batch;
+        size_t _pos;
+        bool _done;
+
+      public:
+        Staged(const Staged& other) = delete;
+        Staged(typename IIterator<T>::Ptr iter, size_t capacity, size_t batchSize)
+            : _iter(iter)
+            , _capacity(capacity)
+            , _batchSize(std::max<size_t>(batchSize, 1))
+            , _batch(nullptr)
+            , _pos(0)
+            , _done(false)
+        {
+        }
+
+        ~Staged()
+        {
+            if (!_thread.joinable())
+                return;
+
+            // Wakes the producer if it waits for room
+            _shared->stop.store(true, std::memory_order_release);
+            _shared->ring.interrupt();
+
+            _thread.join();
+        }
+
+        T* next() override
+        {
+            if (!_shared)
+            {
+                _shared = std::make_shared<Shared>(_iter, _capacity / _batchSize, _batchSize);
+                _thread = std::thread([shared = _shared] { shared->produce(); });
+            }
+
+            while (!_done)
+            {
+                if (_batch && _pos < _batch->items.size())
+                    return &_batch->items[_pos++];
+
+                if (_batch)
+                {
+                    bool last = _batch->last;
+                    _shared->ring.release();
+                    _batch = nullptr;
+
+                    if (last)
+                    {
+                        _done = true;
+                        break;
+                    }
+                }
+
+                _batch = &_shared->ring.front();
+                _pos = 0;
+            }
+
+            if (_shared->error)
+                std::rethrow_exception(std::exchange(_shared->error, nullptr));
+
+            return nullptr;
+        }
+
+        // Only a stage that hasn't started can be cloned; once running,
+        // its upstream belongs to the producer thread
+        typename IIterator<T>::Ptr clone() override
+        {
+            if (_shared)
+                throw std::logic_error("can't clone a running stage");
+
+            return std::make_shared<Staged<T>>(_iter->clone(), _capacity, _batchSize);
+        }
+    };
+
+    // Maps items on a pool of worker threads, yielding results in upstream
+    // order. At most window items are in flight or waiting to be yielded.
+    template <typename Tin, typename Tout>
+    class ParMap : public IIterator<Tout>
+    {
+        struct Slot
+        {
+            std::optional<Tout> value;
+            std::exception_ptr error;
+        };
+
+        struct Shared
+        {
+            typename IIterator<Tin>::Ptr iter;
+            SharedFunction<Tout(const Tin&)> fun;
+            std::vector<Slot> slots;
+
+            std::mutex mutex;
+            std::condition_variable room;
+            std::condition_variable ready;
+
+            size_t claimed = 0;
+            size_t yielded = 0;
+            std::optional<size_t> end;
+            bool stop = false;
+
+            Shared(typename IIterator<Tin>::Ptr iter, SharedFunction<Tout(const Tin&)> fun, size_t window)
+                : iter(iter)
+                , fun(fun)
+                , slots(window)
+            {
+            }
+
+            void work()
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+
+                while (true)
+                {
+                    room.wait(lock, [this] { return stop || end || claimed < yielded + slots.size(); });
+
+                    if (stop || end)
+                        return;
+
+                    auto seq = claimed++;
+                    auto& slot = slots[seq % slots.size()];
+
+                    // Upstream is only ever touched under the lock, in order
+                    std::optional<Tin> item;
+
+                    try
+                    {
+                        if (auto next = iter->next())
+                            item = *next;
+                        else
+                            end = seq;
+                    }
+                    catch (...)
+                    {
+                        slot.error = std::current_exception();
+                        end = seq + 1;
+                    }
+
+                    if (!item)
+                    {
+                        room.notify_all();
+                        ready.notify_one();
+                        return;
+                    }
+
+                    lock.unlock();
+
+                    std::optional<Tout> value;
+                    std::exception_ptr error;
+
+                    try
+                    {
+                        value = fun(*item);
+                    }
+                    catch (...)
+                    {
+                        error = std::current_exception();
+                    }
+
+                    lock.lock();
+
+                    slot.value = std::move(value);
+                    slot.error = error;
+
+                    if (seq == yielded)
+                        ready.notify_one();
+                }
+            }
+        };
+
+        typename IIterator<Tin>::Ptr _iter;
+        SharedFunction<Tout(const Tin&)> _fun;
+        size_t _threads;
+        size_t _window;
+        std::shared_ptr<Shared> _shared;
+        std::vector<std::thread> _workers;
+        std::optional<Tout> _result;
+
+        void start()
+        {
+            _shared = std::make_shared<Shared>(_iter, _fun, _window);
+
+            for (size_t i = 0; i < _threads; i++)
+                _workers.emplace_back([shared = _shared] { shared->work(); });
+        }
+
+      public:
+        ParMap(const ParMap& other) = delete;
+        ParMap(typename IIterator<Tin>::Ptr iter, SharedFunction<Tout(const Tin&)> fun,
+               size_t threads, size_t window)
+            : _iter(iter)
+            , _fun(fun)
+            , _threads(worker_count(threads))
+            , _window(window ? window : 4 * _threads)
+        {
+        }
+
+        ~ParMap()
+        {
+            if (!_shared)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(_shared->mutex);
+                _shared->stop = true;
+            }
+
+            _shared->room.notify_all();
+
+            for (auto& worker : _workers)
+                worker.join();
+        }
+
+        Tout* next() override
+        {
+            if (!_shared)
+                start();
+
+            auto& shared = *_shared;
+            std::unique_lock<std::mutex> lock(shared.mutex);
+
+            auto& slot = shared.slots[shared.yielded % shared.slots.size()];
+
+            shared.ready.wait(lock, [&] {
+                return slot.value || slot.error || shared.end == shared.yielded || shared.stop;
+            });
+
+            if (slot.error)
+            {
+                shared.stop = true;
+                shared.room.notify_all();
+                std::rethrow_exception(std::exchange(slot.error, nullptr));
+            }
+
+            if (!slot.value)
+                return nullptr;
+
+            _result = std::move(slot.value);
+            slot.value.reset();
+            shared.yielded++;
+            shared.room.notify_one();
+
+            return &*_result;
+        }
+
+        std::pair<size_t, std::optional<size_t>> size_hint() override
+        {
+            if (_shared)
+                return IIterator<Tout>::size_hint();
+
+            return _iter->size_hint();
+        }
+
+        // Only a map that hasn't started can be cloned; once running,
+        // its upstream belongs to the worker threads
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            if (_shared)
+                throw std::logic_error("can't clone a running par_map");
+
+            return std::make_shared<ParMap<Tin, Tout>>(_iter->clone(), _fun, _threads, _window);
+        }
+    };
+
+    // Lets several threads consume one upstream, each through its own
+    // worker() iterator. Sources that can be sliced are handed out in
+    // chunks claimed with an atomic cursor; anything else is handed out
+    // in batches copied under a lock.
+    template <typename T>
+    class SharedSource : public std::enable_shared_from_this<SharedSource<T>>
+    {
+        typename IIterator<T>::Ptr _iter;
+        size_t _chunk;
+        size_t _len;
+        bool _indexed;
+        bool _done;
+        std::mutex _mutex;
+        alignas(64) std::atomic<size_t> _cursor;
+
+        friend class SharedWorker<T>;
+
+      public:
+        SharedSource(const SharedSource& other) = delete;
+        SharedSource(typename IIterator<T>::Ptr iter, size_t chunk)
+            : _iter(iter)
+            , _chunk(std::max<size_t>(chunk, 1))
+            , _len(0)
+            , _indexed(false)
+            , _done(false)
+            , _cursor(0)
+        {
+            if (_iter->exact_size(_len))
+                _indexed = _len == 0 || _iter->slice(0, 0);
+
+            // Workers slice a copy, and the upstream is consumed up front
+            // just as batches would consume it
+            if (_indexed && _len)
+            {
+                auto items = _iter->slice(0, _len);
+                _iter->advance_by(_len);
+                _iter = items;
+            }
+        }
+
+        // True when workers claim slices rather than copied batches
+        bool indexed() const
+        {
+            return _indexed;
+        }
+
+        typename IIterator<T>::Ptr worker()
+        {
+            return std::make_shared<SharedWorker<T>>(this->shared_from_this());
+        }
+    };
+
+    template <typename T>
+    class SharedWorker : public IIterator<T>
+    {
+        std::shared_ptr<SharedSource<T>> _source;
+        typename IIterator<T>::Ptr _part;
+        std::vector<T> _batch;
+        size_t _pos;
+
+        bool claim()
+        {
+            auto& source = *_source;
+
+            if (source._indexed)
+            {
+                auto from = source._cursor.fetch_add(source._chunk, std::memory_order_relaxed);
+
+                if (from >= source._len)
+                    return false;
+
+                _part = source._iter->slice(from, std::min(from + source._chunk, source._len));
+                return true;
+            }
+
+            std::lock_guard<std::mutex> lock(source._mutex);
+
+            _batch.clear();
+            _pos = 0;
+
+            while (!source._done && _batch.size() < source._chunk)
+            {
+                if (auto item = source._iter->next())
+                    _batch.push_back(*item);
+                else
+                    source._done = true;
+            }
+
+            return !_batch.empty();
+        }
+
+      public:
+        SharedWorker(const SharedWorker& other) = delete;
+        SharedWorker(std::shared_ptr<SharedSource<T>> source)
+            : _source(source)
+            , _pos(0)
+        {
+        }
+
+        T* next() override
+        {
+            do
+            {
+                if (_part)
+                {
+                    if (auto item = _part->next())
+                        return item;
+                }
+                else if (_pos < _batch.size())
+                {
+                    return &_batch[_pos++];
+                }
+            }
+            while (claim());
+
+            return nullptr;
+        }
+
+        // Workers share a cursor, so there's no independent copy to make
+        typename IIterator<T>::Ptr clone() override
+        {
+            throw std::logic_error("can't clone a shared source worker");
+        }
+    };
+
+    // flat_map on a pool of worker threads, yielding items in no
+    // particular order. Every inner iterator is a task in its owner's
+    // deque; large ones are split in halves that idle workers steal, so
+    // a few huge expansions don't leave the other threads waiting.
+    template <typename Tin, typename Tout>
+    class ParFlatMap : public IIterator<Tout>
+    {
+        using Task = typename IIterator<Tout>::Ptr;
+
+        static constexpr size_t grain = 1024;
+        static constexpr size_t batchSize = 256;
+
+        // Owner pushes and pops at the back, thieves take from the front
+        struct alignas(64) Deque
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        struct Shared
+        {
+            std::shared_ptr<SharedSource<Tin>> source;
+            SharedFunction<Task(const Tin&)> fun;
+            std::vector<Deque> deques;
+
+            // Tasks queued or running, plus outer items being expanded
+            alignas(64) std::atomic<size_t> active;
+            std::atomic<bool> sourceDone;
+            std::atomic<bool> stop;
+
+            // Bumped whenever an idle worker may have something to do
+            std::atomic<size_t> wakeups;
+
+            std::mutex mutex;
+            std::condition_variable room;
+            std::condition_variable ready;
+            std::condition_variable idle;
+            std::deque<std::vector<Tout>> batches;
+            size_t maxBatches;
+            size_t running;
+            std::exception_ptr error;
+
+            Shared(typename IIterator<Tin>::Ptr iter, SharedFunction<Task(const Tin&)> fun, size_t threads)
+                : source(std::make_shared<SharedSource<Tin>>(iter, 1))
+                , fun(fun)
+                , deques(threads)
+                , active(0)
+                , sourceDone(false)
+                , stop(false)
+                , wakeups(0)
+                , maxBatches(4 * threads)
+                , running(threads)
+            {
+            }
+
+            void wake()
+            {
+                wakeups++;
+
+                // Idle workers check wakeups under the lock, so taking it
+                // here means none is between its check and its wait
+                std::lock_guard<std::mutex> lock(mutex);
+                idle.notify_all();
+            }
+
+            void finish_one()
+            {
+                if (--active == 0)
+                    wake();
+            }
+
+            Task pop(size_t self)
+            {
+                auto& own = deques[self];
+                std::lock_guard<std::mutex> lock(own.mutex);
+
+                if (own.tasks.empty())
+                    return nullptr;
+
+                auto task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return task;
+            }
+
+            Task steal(size_t self)
+            {
+                for (size_t i = 1; i < deques.size(); i++)
+                {
+                    auto& victim = deques[(self + i) % deques.size()];
+                    std::lock_guard<std::mutex> lock(victim.mutex);
+
+                    if (!victim.tasks.empty())
+                    {
+                        auto task = std::move(victim.tasks.front());
+                        victim.tasks.pop_front();
+                        return task;
+                    }
+                }
+
+                return nullptr;
+            }
+
+            bool emit(std::vector<Tout>& batch)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                room.wait(lock, [this] { return stop || batches.size() < maxBatches; });
+
+                if (stop)
+                    return false;
+
+                batches.push_back(std::move(batch));
+                batch.clear();
+                ready.notify_one();
+                return true;
+            }
+
+            // Runs task to the end, handing its back halves out while
+            // it's large enough to be worth sharing
+            bool run(size_t self, Task task, std::vector<Tout>& batch)
+            {
+                while (true)
+                {
+                    auto upper = task->size_hint().second;
+
+                    if (!upper || *upper <= grain)
+                        break;
+
+                    auto back = task->split();
+
+                    if (!back)
+                        break;
+
+                    active++;
+
+                    {
+                        std::lock_guard<std::mutex> lock(deques[self].mutex);
+                        deques[self].tasks.push_back(std::move(back));
+                    }
+
+                    wake();
+                }
+
+                while (auto item = task->next())
+                {
+                    batch.push_back(*item);
+
+                    if (batch.size() == batchSize && !emit(batch))
+                        return false;
+                }
+
+                finish_one();
+                return true;
+            }
+
+            void work(size_t self)
+            {
+                std::vector<Tout> batch;
+
+                // However the worker ends, the consumer must see it go
+                struct Done
+                {
+                    Shared& shared;
+
+                    ~Done()
+                    {
+                        std::lock_guard<std::mutex> lock(shared.mutex);
+                        shared.running--;
+                        shared.ready.notify_one();
+                    }
+                } done{*this};
+
+                try
+                {
+                    auto outer = source->worker();
+
+                    while (!stop)
+                    {
+                        auto seen = wakeups.load();
+                        auto task = pop(self);
+
+                        if (!task && !sourceDone)
+                        {
+                            active++;
+
+                            if (auto item = outer->next())
+                            {
+                                task = fun(*item);
+
+                                // nullptr is an empty expansion
+                                if (!task)
+                                    finish_one();
+                            }
+                            else
+                            {
+                                sourceDone = true;
+                                finish_one();
+                            }
+                        }
+
+                        if (!task)
+                            task = steal(self);
+
+                        if (task)
+                        {
+                            if (!run(self, task, batch))
+                                return;
+                        }
+                        else if (sourceDone && active == 0)
+                        {
+                            break;
+                        }
+                        else
+                        {
+                            // Others still run tasks they may split
+                            std::unique_lock<std::mutex> lock(mutex);
+                            idle.wait(lock, [&] { return stop || wakeups != seen; });
+                        }
+                    }
+
+                    if (!batch.empty())
+                        emit(batch);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    if (!error)
+                        error = std::current_exception();
+
+                    stop = true;
+                    room.notify_all();
+                    idle.notify_all();
+                }
+            }
+        };
+
+        typename IIterator<Tin>::Ptr _iter;
+        SharedFunction<Task(const Tin&)> _fun;
+        size_t _threads;
+        std::shared_ptr<Shared> _shared;
+        std::vector<std::thread> _workers;
+        std::vector<Tout> _batch;
+        size_t _pos;
+
+        void start()
+        {
+            _shared = std::make_shared<Shared>(_iter, _fun, _threads);
+
+            for (size_t i = 0; i < _threads; i++)
+                _workers.emplace_back([shared = _shared, i] { shared->work(i); });
+        }
+
+      public:
+        ParFlatMap(const ParFlatMap& other) = delete;
+        ParFlatMap(typename IIterator<Tin>::Ptr iter, SharedFunction<Task(const Tin&)> fun, size_t threads)
+            : _iter(iter)
+            , _fun(fun)
+            , _threads(worker_count(threads))
+            , _pos(0)
+        {
+        }
+
+        ~ParFlatMap()
+        {
+            if (!_shared)
+                return;
+
+            {
+                std::lock_guard<std::mutex> lock(_shared->mutex);
+                _shared->stop = true;
+            }
+
+            _shared->room.notify_all();
+            _shared->idle.notify_all();
+
+            for (auto& worker : _workers)
+                worker.join();
+        }
+
+        Tout* next() override
+        {
+            if (_pos < _batch.size())
+                return &_batch[_pos++];
+
+            if (!_shared)
+                start();
+
+            auto& shared = *_shared;
+            std::unique_lock<std::mutex> lock(shared.mutex);
+
+            shared.ready.wait(lock, [&] {
+                return !shared.batches.empty() || shared.running == 0 || shared.error;
+            });
+
+            if (shared.error)
+                std::rethrow_exception(std::exchange(shared.error, nullptr));
+
+            if (shared.batches.empty())
+                return nullptr;
+
+            _batch = std::move(shared.batches.front());
+            shared.batches.pop_front();
+            shared.room.notify_one();
+
+            _pos = 1;
+            return &_batch[0];
+        }
+
+        // Only an adapter that hasn't started can be cloned; once running,
+        // its upstream belongs to the worker threads
+        typename IIterator<Tout>::Ptr clone() override
+        {
+            if (_shared)
+                throw std::logic_error("can't clone a running par_flat_map");
+
+            return std::make_shared<ParFlatMap<Tin, Tout>>(_iter->clone(), _fun, _threads);
+        }
+    };
+
+    // Bounded lock-free multi-producer multi-consumer queue. Every cell
+    // has a sequence number telling whether it's ready for the push or
+    // the pop at a given position, so producers only race each other on
+    // the push position and consumers on the pop position.
+    template <typename T>
+    class MpmcQueue
+    {
+        struct Cell
+        {
+            std::atomic<size_t> sequence;
+            std::optional<T> value;
+        };
+
+        std::unique_ptr<Cell[]> _cells;
+        size_t _mask;
+
+        alignas(64) std::atomic<size_t> _pushPos;
+        alignas(64) std::atomic<size_t> _popPos;
+
+      public:
+        MpmcQueue(const MpmcQueue& other) = delete;
+
+        // Capacity is rounded up to a power of two
+        MpmcQueue(size_t capacity)
+            : _pushPos(0)
+            , _popPos(0)
+        {
+            size_t size = 2;
+
+            while (size < capacity)
+                size *= 2;
+
+            _cells.reset(new Cell[size]);
+            _mask = size - 1;
+
+            for (size_t i = 0; i < size; i++)
+                _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+
+        // Leaves value untouched and returns false when full
+        template <typename U>
+        bool try_push(U&& value)
+        {
+            auto pos = _pushPos.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                auto& cell = _cells[pos & _mask];
+                auto seq = cell.sequence.load(std::memory_order_acquire);
+                auto diff = std::ptrdiff_t(seq - pos);
+
+                if (diff == 0)
+                {
+                    if (_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        cell.value.emplace(std::forward<U>(value));
+                        cell.sequence.store(pos + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = _pushPos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool try_pop(std::optional<T>& out)
+        {
+            auto pos = _popPos.load(std::memory_order_relaxed);
+
+            while (true)
+            {
+                auto& cell = _cells[pos & _mask];
+                auto seq = cell.sequence.load(std::memory_order_acquire);
+                auto diff = std::ptrdiff_t(seq - (pos + 1));
+
+                if (diff == 0)
+                {
+                    if (_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    {
+                        out = std::move(cell.value);
+                        cell.value.reset();
+                        cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (diff < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    pos = _popPos.load(std::memory_order_relaxed);
+                }
+            }
+        }
+    };
+
+    // State shared by the senders and receivers of a channel. Blocking
+    // waits on event counters bumped after every push and pop; they
+    // only make a system call when someone is actually asleep.
+    template <typename T>
+    class Channel
+    {
+        MpmcQueue<T> _queue;
+
+        alignas(64) std::atomic<size_t> _pushes;
+        std::atomic<size_t> _pushWaiters;
+
+        alignas(64) std::atomic<size_t> _pops;
+        std::atomic<size_t> _popWaiters;
+
+        std::atomic<size_t> _senders;
+        std::atomic<size_t> _receivers;
+
+        void pushed()
+        {
+            _pushes.fetch_add(1);
+
+            if (_popWaiters.load())
+                notify_waiters(_pushes);
+        }
+
+        void popped()
+        {
+            _pops.fetch_add(1);
+
+            if (_pushWaiters.load())
+                notify_waiters(_pops);
+        }
+
+        friend class Sender<T>;
+        friend class Receiver<T>;
+
+      public:
+        Channel(const Channel& other) = delete;
+        Channel(size_t capacity)
+            : _queue(capacity)
+            , _pushes(0)
+            , _pushWaiters(0)
+            , _pops(0)
+            , _popWaiters(0)
+            , _senders(0)
+            , _receivers(0)
+        {
+        }
+
+        // Blocks while the queue is full. Returns false, leaving value
+        // untouched, once every receiver is gone.
+        template <typename U>
+        bool push(U&& value)
+        {
+            while (true)
+            {
+                auto seen = _pops.load();
+
+                if (!_receivers.load())
+                    return false;
+
+                if (_queue.try_push(std::forward<U>(value)))
+                {
+                    pushed();
+                    return true;
+                }
+
+                _pushWaiters.fetch_add(1);
+                wait_while_equal(_pops, seen);
+                _pushWaiters.fetch_sub(1);
+            }
+        }
+
+        template <typename U>
+        bool try_push(U&& value)
+        {
+            if (!_receivers.load() || !_queue.try_push(std::forward<U>(value)))
+                return false;
+
+            pushed();
+            return true;
+        }
+
+        // Blocks while the queue is empty. Returns false once it's empty
+        // and every sender is gone.
+        bool pop(std::optional<T>& out)
+        {
+            while (true)
+            {
+                auto seen = _pushes.load();
+
+                if (_queue.try_pop(out))
+                {
+                    popped();
+                    return true;
+                }
+
+                // Senders are gone, but may have pushed before leaving
+                if (!_senders.load())
+                {
+                    if (!_queue.try_pop(out))
+                        return false;
+
+                    popped();
+                    return true;
+                }
+
+                _popWaiters.fetch_add(1);
+                wait_while_equal(_pushes, seen);
+                _popWaiters.fetch_sub(1);
+            }
+        }
+    };
+
+    // Sending end of a channel. Copies are more senders; the channel is
+    // closed when the last one is destroyed.
+    template <typename T>
+    class Sender
+    {
+        std::shared_ptr<Channel<T>> _channel;
+
+        void release()
+        {
+            if (_channel && _channel->_senders.fetch_sub(1) == 1)
+            {
+                // Wakes receivers so they notice
+                _channel->_pushes.fetch_add(1);
+                notify_waiters(_channel->_pushes);
+            }
+        }
+
+      public:
+        Sender(std::shared_ptr<Channel<T>> channel)
+            : _channel(channel)
+        {
+            _channel->_senders++;
+        }
+
+        Sender(const Sender& other)
+            : Sender(other._channel)
+        {
+        }
+
+        Sender(Sender&& other) = default;
+
+        Sender& operator=(Sender other)
+        {
+            release();
+            _channel = std::move(other._channel);
+            return *this;
+        }
+
+        ~Sender()
+        {
+            release();
+        }
+
+        // Blocks while the channel is full. Returns false, leaving value
+        // untouched, when no receiver is left.
+        template <typename U>
+        bool send(U&& value) const
+        {
+            return _channel->push(std::forward<U>(value));
+        }
+
+        // Like send(), but returns false instead of blocking
+        template <typename U>
+        bool try_send(U&& value) const
+        {
+            return _channel->try_push(std::forward<U>(value));
+        }
+
+        // Closes the channel if this was the last sender
+        void close()
+        {
+            release();
+            _channel.reset();
+        }
+    };
+
+    // Receiving end of a channel: yields items until the channel is
+    // empty and closed, blocking while it's only empty
+    template <typename T>
+    class Receiver : public IIterator<T>
+    {
+        std::shared_ptr<Channel<T>> _channel;
+        std::optional<T> _current;
+
+      public:
+        Receiver(const Receiver& other) = delete;
+        Receiver(std::shared_ptr<Channel<T>> channel)
+            : _channel(channel)
+        {
+            _channel->_receivers++;
+        }
+
+        ~Receiver()
+        {
+            if (_channel->_receivers.fetch_sub(1) == 1)
+            {
+                // Wakes senders so they notice
+                _channel->_pops.fetch_add(1);
+                notify_waiters(_channel->_pops);
+            }
+        }
+
+        T* next() override
+        {
+            if (!_channel->pop(_current))
+                return nullptr;
+
+            return &*_current;
+        }
+
+        // Another receiver on the same channel, competing with this one
+        // for items
+        auto receiver()
+        {
+            return std::make_shared<Receiver<T>>(_channel);
+        }
+
+        // Items go to whichever receiver asks first, so no receiver
+        // can replay them
+        typename IIterator<T>::Ptr clone() override
+        {
+            throw std::logic_error("can't clone a channel receiver");
+        }
+    };
+
+    // Push-based counterpart of IIterator: a producer hands every item to
+    // on_next and calls on_complete at the end. on_next returns false
+    // once the observer wants no more items.
+    template <typename T>
+    class Observer
+    {
+        public:
+            using Ptr = std::shared_ptr<Observer>;
+
+            virtual bool on_next(const T& item) = 0;
+            virtual void on_complete() {}
+            virtual ~Observer(){};
+    };
+
+    // Push stages. Each one owns the stage after it by value, so a whole
+    // Pipe compiles into one object whose calls can be inlined.
+    template <typename U, typename Down, typename F>
+    class MapSink
+    {
+        Down _down;
+        F _fun;
+
+      public:
+        MapSink(Down down, F fun)
+            : _down(std::move(down))
+            , _fun(std::move(fun))
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            return _down.on_next(_fun(item));
+        }
+
+        void on_complete()
+        {
+            _down.on_complete();
+        }
+    };
+
+    template <typename U, typename Down, typename F>
+    class FilterSink
+    {
+        Down _down;
+        F _predicate;
+
+      public:
+        FilterSink(Down down, F predicate)
+            : _down(std::move(down))
+            , _predicate(std::move(predicate))
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            return !_predicate(item) || _down.on_next(item);
+        }
+
+        void on_complete()
+        {
+            _down.on_complete();
+        }
+    };
+
+    template <typename U, typename Down, typename F>
+    class InspectSink
+    {
+        Down _down;
+        F _fun;
+
+      public:
+        InspectSink(Down down, F fun)
+            : _down(std::move(down))
+            , _fun(std::move(fun))
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            _fun(item);
+            return _down.on_next(item);
+        }
+
+        void on_complete()
+        {
+            _down.on_complete();
+        }
+    };
+
+    // Completes downstream as soon as count items went through
+    template <typename U, typename Down>
+    class TakeSink
+    {
+        Down _down;
+        size_t _count;
+        bool _completed;
+
+      public:
+        TakeSink(Down down, size_t count)
+            : _down(std::move(down))
+            , _count(count)
+            , _completed(false)
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            if (_count == 0)
+            {
+                on_complete();
+                return false;
+            }
+
+            bool more = _down.on_next(item);
+
+            if (--_count == 0)
+            {
+                on_complete();
+                return false;
+            }
+
+            return more;
+        }
+
+        void on_complete()
+        {
+            if (!_completed)
+            {
+                _completed = true;
+                _down.on_complete();
+            }
+        }
+    };
+
+    template <typename U, typename Tout, typename Down, typename F>
+    class ScanSink
+    {
+        Down _down;
+        Tout _state;
+        F _fun;
+
+      public:
+        ScanSink(Down down, Tout init, F fun)
+            : _down(std::move(down))
+            , _state(std::move(init))
+            , _fun(std::move(fun))
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            _state = _fun(_state, item);
+            return _down.on_next(_state);
+        }
+
+        void on_complete()
+        {
+            _down.on_complete();
+        }
+    };
+
+    // Passes items on in vectors of size items; the last may be shorter
+    template <typename U, typename Down>
+    class ChunksSink
+    {
+        Down _down;
+        size_t _size;
+        std::vector<U> _chunk;
+
+      public:
+        ChunksSink(Down down, size_t size)
+            : _down(std::move(down))
+            , _size(std::max<size_t>(size, 1))
+        {
+            _chunk.reserve(_size);
+        }
+
+        bool on_next(const U& item)
+        {
+            _chunk.push_back(item);
+
+            if (_chunk.size() < _size)
+                return true;
+
+            bool more = _down.on_next(_chunk);
+            _chunk.clear();
+            return more;
+        }
+
+        void on_complete()
+        {
+            if (!_chunk.empty())
+            {
+                _down.on_next(_chunk);
+                _chunk.clear();
+            }
+
+            _down.on_complete();
+        }
+    };
+
+    template <typename U, typename F>
+    class FunctionSink
+    {
+        F _fun;
+
+      public:
+        FunctionSink(F fun)
+            : _fun(std::move(fun))
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            _fun(item);
+            return true;
+        }
+
+        void on_complete()
+        {
+        }
+    };
+
+    template <typename U>
+    class ObserverSink
+    {
+        typename Observer<U>::Ptr _observer;
+
+      public:
+        ObserverSink(typename Observer<U>::Ptr observer)
+            : _observer(observer)
+        {
+        }
+
+        bool on_next(const U& item)
+        {
+            return _observer->on_next(item);
+        }
+
+        void on_complete()
+        {
+            _observer->on_complete();
+        }
+    };
+
+    // The one virtual hop between a producer and a composed sink. Ignores
+    // items after the sink asked to stop and completes it only once.
+    template <typename T, typename Sink>
+    class SinkObserver : public Observer<T>
+    {
+        Sink _sink;
+        bool _stopped;
+        bool _completed;
+
+      public:
+        SinkObserver(Sink sink)
+            : _sink(std::move(sink))
+            , _stopped(false)
+            , _completed(false)
+        {
+        }
+
+        bool on_next(const T& item) override
+        {
+            if (_stopped)
+                return false;
+
+            _stopped = !_sink.on_next(item);
+            return !_stopped;
+        }
+
+        void on_complete() override
+        {
+            if (!_completed)
+            {
+                _completed = true;
+                _sink.on_complete();
+            }
+        }
+    };
+
+    // Describes a push pipeline taking T and producing U. build wraps the
+    // sink for U in the pipeline's stages, giving a sink for T; nothing
+    // runs until subscribe() or for_each() makes the Observer.
+    template <typename T, typename U, typename Build>
+    class Pipe
+    {
+        Build _build;
+
+        template <typename Tout, typename Wrap>
+        auto then(Wrap wrap) const
+        {
+            auto build = [build = _build, wrap](auto down) { return build(wrap(std::move(down))); };
+            return Pipe<T, Tout, decltype(build)>(build);
+        }
+
+      public:
+        Pipe(Build build)
+            : _build(build)
+        {
+        }
+
+        template <typename F>
+        auto map(F fun) const
+        {
+            using Tout = std::decay_t<decltype(fun(std::declval<const U&>()))>;
+
+            return then<Tout>([fun](auto down) {
+                return MapSink<U, decltype(down), F>(std::move(down), fun);
+            });
+        }
+
+        template <typename F>
+        auto filter(F predicate) const
+        {
+            return then<U>([predicate](auto down) {
+                return FilterSink<U, decltype(down), F>(std::move(down), predicate);
+            });
+        }
+
+        template <typename F>
+        auto inspect(F fun) const
+        {
+            return then<U>([fun](auto down) {
+                return InspectSink<U, decltype(down), F>(std::move(down), fun);
+            });
+        }
+
+        auto take(size_t count) const
+        {
+            return then<U>([count](auto down) {
+                return TakeSink<U, decltype(down)>(std::move(down), count);
+            });
+        }
+
+        template <typename Tout, typename F>
+        auto scan(const Tout& init, F fun) const
+        {
+            return then<Tout>([init, fun](auto down) {
+                return ScanSink<U, Tout, decltype(down), F>(std::move(down), init, fun);
+            });
+        }
+
+        auto chunks(size_t size) const
+        {
+            return then<std::vector<U>>([size](auto down) {
+                return ChunksSink<U, decltype(down)>(std::move(down), size);
+            });
+        }
+
+        // Observer running the pipeline into observer
+        typename Observer<T>::Ptr subscribe(typename Observer<U>::Ptr observer) const
+        {
+            auto sink = _build(ObserverSink<U>(observer));
+            return std::make_shared<SinkObserver<T, decltype(sink)>>(std::move(sink));
+        }
+
+        // Observer running the pipeline and calling fun on every result
+        template <typename F>
+        typename Observer<T>::Ptr for_each(F fun) const
+        {
+            auto sink = _build(FunctionSink<U, F>(fun));
+            return std::make_shared<SinkObserver<T, decltype(sink)>>(std::move(sink));
+        }
+    };
+
+#if defined(__cpp_impl_coroutine)
+    // Keeps freed coroutine frames on a per-thread list per size class and
+    // hands them out again, so creating a generator in a loop doesn't
+    // go through the heap every time
+    class FramePool
+    {
+        static constexpr size_t granularity = 64;
+        static constexpr size_t classes = 32;
+        static constexpr size_t maxCached = 64;
+
+        struct Node
+        {
+            Node* next;
+        };
+
+        Node* _free[classes] = {};
+        size_t _cached[classes] = {};
+
+        static size_t size_class(size_t size)
+        {
+            return (size + granularity - 1) / granularity - 1;
+        }
+
+      public:
+        FramePool() = default;
+        FramePool(const FramePool& other) = delete;
+
+        ~FramePool()
+        {
+            for (auto node : _free)
+            {
+                while (node)
+                {
+                    auto next = node->next;
+                    ::operator delete(node);
+                    node = next;
+                }
+            }
+        }
+
+        static FramePool& local()
+        {
+            thread_local FramePool pool;
+            return pool;
+        }
+
+        void* allocate(size_t size)
+        {
+            auto cls = size_class(size);
+
+            if (cls >= classes)
+                return ::operator new(size);
+
+            if (auto node = _free[cls])
+            {
+                _free[cls] = node->next;
+                _cached[cls]--;
+                return node;
+            }
+
+            return ::operator new((cls + 1) * granularity);
+        }
+
+        void deallocate(void* ptr, size_t size)
+        {
+            auto cls = size_class(size);
+
+            if (cls >= classes || _cached[cls] == maxCached)
+            {
+                ::operator delete(ptr);
+                return;
+            }
+
+            auto node = static_cast<Node*>(ptr);
+            node->next = _free[cls];
+            _free[cls] = node;
+            _cached[cls]++;
+        }
+
+        size_t cached() const
+        {
+            size_t total = 0;
+
+            for (auto count : _cached)
+                total += count;
+
+            return total;
+        }
+    };
 
-                return true;
-            }
+    template <typename T>
+    class generator
+    {
+      public:
+        struct promise_type
+        {
+            T* _current = nullptr;
+            std::optional<T> _copy;
 
-            bool any(std::function<bool(const T&)> predicate)
+            generator get_return_object()
             {
-                while (auto item = next())
-                    if (predicate(*item))
-                        return true;
-
-                return false;
+                return generator(std::coroutine_handle<promise_type>::from_promise(*this));
             }
 
-            T* find(std::function<bool(const T&)> predicate)
+            std::suspend_always initial_suspend() noexcept
             {
-                while (auto item = next())
-                    if (predicate(*item))
-                        return item;
-
-                return nullptr;
+                return {};
             }
 
-            std::optional<size_t> position(std::function<bool(const T&)> predicate)
+            std::suspend_always final_suspend() noexcept
             {
-                size_t count = 0;
-
-                while (auto item = next())
-                    if (predicate(*item))
-                        return count;
-                    else
-                        ++count;
-
                 return {};
             }
 
-            std::optional<T> max()
+            // Yielded values stay alive while the coroutine is suspended,
+            // so next() can point at them; only const values are copied
+            std::suspend_always yield_value(T& value) noexcept
             {
-                return max_by([](auto& a, auto& b) { return a < b; });
+                _current = std::addressof(value);
+                return {};
             }
-            
-            std::optional<T> max_by(std::function<bool(const T& a, const T& b)> cmp)
-            {
-                std::optional<T> max;
-
-                while (auto item = next())
-                {
-                    if (!max)
-                        max = *item;
-                    else if (!cmp(*item, *max))
-                        max = *item;
-                }
 
-                return max;
+            std::suspend_always yield_value(T&& value) noexcept
+            {
+                _current = std::addressof(value);
+                return {};
             }
 
-            std::optional<T> min()
+            std::suspend_always yield_value(const T& value)
             {
-                return min_by([](auto& a, auto& b) { return a < b; });
+                _copy.emplace(value);
+                _current = std::addressof(*_copy);
+                return {};
             }
 
-            std::optional<T> min_by(std::function<bool(const T& a, const T& b)> cmp)
+            void return_void()
             {
-                std::optional<T> min;
-
-                while (auto item = next())
-                {
-                    if (!min)
-                        min = *item;
-                    else if (cmp(*item, *min))
-                        min = *item;
-                }
+            }
 
-                return min;
+            // Propagates out of the resume() in next()
+            void unhandled_exception()
+            {
+                throw;
             }
 
-            void for_each(std::function<void(const T&)> fun)
+            static void* operator new(size_t size)
             {
-                while (auto item = next())
-                    fun(*item);
+                return FramePool::local().allocate(size);
             }
 
-            size_t count()
+            static void operator delete(void* ptr, size_t size)
             {
-                size_t cnt = 0;
+                FramePool::local().deallocate(ptr, size);
+            }
+        };
 
-                while (next())
-                    cnt++;
+      private:
+        std::shared_ptr<CoroutineIter<T>> _iter;
 
-                return cnt;
-            }
+        generator(std::coroutine_handle<promise_type> handle)
+            : _iter(std::make_shared<CoroutineIter<T>>(handle))
+        {
+        }
 
-            T sum()
-            {
-                T sum = T(0);
+      public:
+        CoroutineIter<T>* operator->() const
+        {
+            return _iter.get();
+        }
 
-                while(auto item = next())
-                    sum = sum + *item;
+        operator std::shared_ptr<CoroutineIter<T>>() const
+        {
+            return _iter;
+        }
 
-                return sum;
-            }
-            
-            T product()
-            {
-                T prod = T(1);
+        operator typename IIterator<T>::Ptr() const
+        {
+            return _iter;
+        }
+    };
 
-                while(auto item = next())
-                    prod = prod * *item;
+    template <typename T>
+    class CoroutineIter : public IIterator<T>
+    {
+        using Handle = std::coroutine_handle<typename generator<T>::promise_type>;
 
-                return prod;
-            }
+        Handle _handle;
 
-            template <typename Tout>
-            auto fold(const Tout& init,
-                    std::function<Tout(const T& init, const T& current)> function)
-            {
-                Tout res = init;
+      public:
+        CoroutineIter(const CoroutineIter& other) = delete;
+        CoroutineIter(Handle handle)
+            : _handle(handle)
+        {
+        }
 
-                while (auto item = next())
-                    res = function(res, *item);
+        ~CoroutineIter()
+        {
+            if (_handle)
+                _handle.destroy();
+        }
 
-                return res;
-            }
+        T* next() override
+        {
+            if (_handle.done())
+                return nullptr;
 
-            bool eq(IIterator<T>::Ptr other)
-            {
-                T* fst = nullptr;
-                T* snd = nullptr;
+            _handle.resume();
 
-                while (true)
-                {
-                    fst = next();
-                    snd = other->next();
+            if (_handle.done())
+                return nullptr;
 
-                    if (!fst && snd)
-                        return false;
-                    else if (fst && !snd)
-                        return false;
-                    else if (!fst && !snd)
-                        return true;
-                    else if (*fst != *snd)
-                        return false;
-                    else
-                        continue;
-                }
-            }
-            
-            bool ne(IIterator<T>::Ptr other)
-            {
-                T* fst = nullptr;
-                T* snd = nullptr;
+            return _handle.promise()._current;
+        }
 
-                while (true)
-                {
-                    fst = next();
-                    snd = other->next();
+        // A suspended coroutine can't be copied
+        typename IIterator<T>::Ptr clone() override
+        {
+            throw std::logic_error("ri::generator can't be cloned");
+        }
+    };
 
-                    if (!fst && snd)
-                        return true;
-                    else if (fst && !snd)
-                        return true;
-                    else if (!fst && !snd)
-                        return true;
-                    else if (*fst == *snd)
-                        return false;
-                    else
-                        continue;
-                }
-            }
+    // Lazily started coroutine producing a T, resumed by whoever awaits it
+    template <typename T>
+    class Task;
+
+    template <typename T>
+    struct TaskResult
+    {
+        std::optional<T> _value;
+
+        void return_value(T value)
+        {
+            _value.emplace(std::move(value));
+        }
+
+        T take()
+        {
+            return std::move(*_value);
+        }
     };
 
-    template <typename Container>
-    class Iter : public IIterator<typename Container::value_type>
+    template <>
+    struct TaskResult<void>
     {
-        protected:
-            typename Container::iterator _begin;
-            typename Container::iterator _end;
+        void return_void()
+        {
+        }
 
-        public:
-            Iter(const Iter& other) = default;
-            Iter(Container& cont)
-                : _begin(std::begin(cont))
-                , _end(std::end(cont))
+        void take()
+        {
+        }
+    };
+
+    template <typename T>
+    class Task
+    {
+      public:
+        struct promise_type : TaskResult<T>
+        {
+            std::coroutine_handle<> _continuation = std::noop_coroutine();
+            std::exception_ptr _error;
+
+            Task get_return_object()
             {
+                return Task(std::coroutine_handle<promise_type>::from_promise(*this));
             }
 
-            typename Container::value_type* next() override
+            std::suspend_always initial_suspend() noexcept
             {
-                if (_begin == _end)
-                {
-                    return nullptr;
-                }
-                else
+                return {};
+            }
+
+            // Hands control straight back to the awaiting coroutine
+            auto final_suspend() noexcept
+            {
+                struct Final
                 {
-                    auto& res = *_begin;
-                    _begin++;
-                    return &res;
-                }
+                    bool await_ready() noexcept
+                    {
+                        return false;
+                    }
+
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                    {
+                        return handle.promise()._continuation;
+                    }
+
+                    void await_resume() noexcept
+                    {
+                    }
+                };
+
+                return Final{};
             }
 
-            typename IIterator<typename Container::value_type>::Ptr clone() override
+            void unhandled_exception()
             {
-                return std::make_shared<Iter<Container>>(*this);
+                _error = std::current_exception();
             }
-    };
-    
-    template <typename T>
-    class Generator : public IIterator<T>
-    {
-        protected:
-            T _current;
-            std::function<void(T&)> _increment;
-            bool _first;
 
-        public:
-            Generator(const Generator& other) = default;
-            Generator(const T& start, std::function<void(T&)> increment)
-                : _current(start)
-                , _increment(increment)
-                , _first(true)
+            static void* operator new(size_t size)
             {
+                return FramePool::local().allocate(size);
             }
 
-            T* next() override
+            static void operator delete(void* ptr, size_t size)
             {
-                if (_first)
+                FramePool::local().deallocate(ptr, size);
+            }
+        };
+
+      private:
+        std::coroutine_handle<promise_type> _handle;
+
+        Task(std::coroutine_handle<promise_type> handle)
+            : _handle(handle)
+        {
+        }
+
+      public:
+        Task(const Task& other) = delete;
+        Task(Task&& other) noexcept
+            : _handle(std::exchange(other._handle, {}))
+        {
+        }
+
+        ~Task()
+        {
+            if (_handle)
+                _handle.destroy();
+        }
+
+        auto operator co_await() noexcept
+        {
+            struct Awaiter
+            {
+                std::coroutine_handle<promise_type> _handle;
+
+                bool await_ready() noexcept
                 {
-                    _first = false;
-                    return &_current;
+                    return false;
+                }
+
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+                {
+                    _handle.promise()._continuation = continuation;
+                    return _handle;
                 }
-                else
+
+                T await_resume()
                 {
-                    _increment(_current);
-                    return &_current;
+                    if (_handle.promise()._error)
+                        std::rethrow_exception(_handle.promise()._error);
+
+                    return _handle.promise().take();
                 }
-            }            
-            
-            typename IIterator<T>::Ptr clone() override
-            {
-                return std::make_shared<Generator<T>>(*this);
-            }
+            };
 
+            return Awaiter{_handle};
+        }
     };
 
-    template <typename T>
-    class Empty : public IIterator<T>
+#if defined(__linux__)
+    // Single-threaded scheduler: runs ready coroutines and parks the ones
+    // waiting on file descriptors in epoll, so one thread can drive many
+    // concurrent pipelines
+    class EventLoop
     {
-        public:
-            Empty(const Empty& other) = default;
-            Empty()
+        // Detached wrapper around a spawned task; frees itself when done
+        struct Spawned
+        {
+            struct promise_type
             {
-            }
+                Spawned get_return_object()
+                {
+                    return {std::coroutine_handle<promise_type>::from_promise(*this)};
+                }
 
-            T* next() override
-            {
-                return nullptr;
-            }
+                std::suspend_always initial_suspend() noexcept
+                {
+                    return {};
+                }
 
-            typename IIterator<T>::Ptr clone() override
-            {
-                return std::make_shared<Empty<T>>(*this);
-            }
-    };
+                std::suspend_never final_suspend() noexcept
+                {
+                    return {};
+                }
 
-    template <typename T>
-    class Once : public IIterator<T>
-    {
-        T _value;
-        bool _emitted;
+                void return_void()
+                {
+                }
 
-        public:
-            Once(const Once& other) = default;
-            Once(const T& value)
-                : _value(value)
-                , _emitted(false)
+                // Lets the frame finish and free itself; run() rethrows
+                void unhandled_exception()
+                {
+                    current()._error = std::current_exception();
+                }
+            };
+
+            std::coroutine_handle<promise_type> _handle;
+        };
+
+        struct FdAwaiter
+        {
+            EventLoop& _loop;
+            int _fd;
+            uint32_t _events;
+
+            bool await_ready() noexcept
             {
+                return false;
             }
 
-            T* next() override
+            void await_suspend(std::coroutine_handle<> handle)
             {
-                if (!_emitted)
-                {
-                    _emitted = true;
-                    return &_value;
-                }
-                else
-                {
-                    return nullptr;
-                }
+                _loop.watch(_fd, _events, handle);
             }
 
-            typename IIterator<T>::Ptr clone() override
+            void await_resume() noexcept
             {
-                return std::make_shared<Once<T>>(*this);
             }
-    };
+        };
 
-    template <typename T>
-    class Repeat : public IIterator<T>
-    {
-        T _value;
+        struct YieldAwaiter
+        {
+            EventLoop& _loop;
 
-        public:
-            Repeat(const Repeat& other) = default;
-            Repeat(const T& value)
-                : _value(value)
+            bool await_ready() noexcept
             {
+                return false;
             }
 
-            T* next() override
+            void await_suspend(std::coroutine_handle<> handle)
             {
-                return &_value;
+                _loop.schedule(handle);
             }
 
-            typename IIterator<T>::Ptr clone() override
+            void await_resume() noexcept
             {
-                return std::make_shared<Repeat<T>>(*this);
             }
-    };
+        };
 
-    class LinesInFile : public IIterator<std::string>
-    {
-        fs::path _path;
-        std::ifstream _file;
-        std::string _currentLine;
+        struct Waiter
+        {
+            uint32_t events;
+            std::coroutine_handle<> handle;
+        };
 
-      public:
-        LinesInFile(const LinesInFile& other)
-            : _path(other._path)
-            , _file(_path)
+        int _epoll;
+        std::deque<std::coroutine_handle<>> _ready;
+        std::unordered_map<int, std::vector<Waiter>> _waiters;
+        size_t _waiting;
+        std::exception_ptr _error;
+
+        static EventLoop*& current_ptr()
         {
+            thread_local EventLoop* loop = nullptr;
+            return loop;
         }
 
-        LinesInFile(const fs::path& path)
-            : _path(path)
-            , _file(_path)
+        static Spawned launch(Task<void> task)
         {
+            co_await task;
         }
 
-        std::string* next() override
+        template <typename T>
+        static Task<void> store(Task<T> task, std::optional<T>& result)
         {
-            if (!_file.is_open())
-                return nullptr;
-
-            if (std::getline(_file, _currentLine))
-                return &_currentLine;
-            else
-                return nullptr;
+            result.emplace(co_await task);
         }
 
-        typename IIterator<std::string>::Ptr clone() override
+        // Arms fd for the events of all its waiters, once
+        bool arm(int fd)
         {
-            return std::make_shared<LinesInFile>(*this);
-        }
-    };
+            epoll_event ev{};
+            ev.events = EPOLLONESHOT;
+            ev.data.fd = fd;
 
-    template <typename T>
-    class Take : public IIterator<T>
-    {
-        typename IIterator<T>::Ptr _iter;
-        int _count;
+            for (auto& waiter : _waiters[fd])
+                ev.events |= waiter.events;
 
-      public:
-        Take(const Take& other) = default;
-        Take(typename IIterator<T>::Ptr iter, int count) 
-            : _iter(iter)
-            , _count(count)
-        {
+            return ::epoll_ctl(_epoll, EPOLL_CTL_MOD, fd, &ev) == 0
+                || (errno == ENOENT && ::epoll_ctl(_epoll, EPOLL_CTL_ADD, fd, &ev) == 0);
         }
 
-        T* next() override
+        // Any number of coroutines can wait on one fd; sources epoll
+        // can't watch (regular files) are always ready
+        void watch(int fd, uint32_t events, std::coroutine_handle<> handle)
         {
-            if (_count > 0)
-            if (auto item = _iter->next())
+            auto& waiters = _waiters[fd];
+            waiters.push_back({events, handle});
+
+            if (arm(fd))
             {
-                _count--;
-                return item;
+                _waiting++;
+                return;
             }
 
-            return nullptr;
+            waiters.pop_back();
+
+            if (waiters.empty())
+                _waiters.erase(fd);
+
+            schedule(handle);
         }
 
-        typename IIterator<T>::Ptr clone() override
+        // Wakes the waiters whose events fired and re-arms fd for the rest
+        void wake(int fd, uint32_t fired)
         {
-            return std::make_shared<Take<T>>(*this);
-        }
-    };
+            auto found = _waiters.find(fd);
 
-    template <typename T>
-    class TakeWhile : public IIterator<T>
-    {
-        typename IIterator<T>::Ptr _iter;
-        std::function<bool(const T&)> _pred;
-        bool _done;
+            if (found == _waiters.end())
+                return;
 
-      public:
-        TakeWhile(const TakeWhile& other) = default;
-        TakeWhile(typename IIterator<T>::Ptr iter, std::function<bool(const T&)> pred) 
-            : _iter(iter)
-            , _pred(pred)
-            , _done(false)
-        {
-        }
+            auto& waiters = found->second;
+            std::vector<Waiter> rest;
 
-        T* next() override
-        {
-            while (auto item = _iter->next())
+            for (auto& waiter : waiters)
             {
-                if (!_done && _pred(*item))
+                if ((waiter.events & fired) || (fired & (EPOLLERR | EPOLLHUP)))
                 {
-                    return item;
+                    _waiting--;
+                    schedule(waiter.handle);
                 }
                 else
                 {
-                    _done = false;
-                    return nullptr;
+                    rest.push_back(waiter);
                 }
             }
 
-            return nullptr;
+            waiters = std::move(rest);
+
+            if (!waiters.empty() && arm(fd))
+                return;
+
+            for (auto& waiter : waiters)
+            {
+                _waiting--;
+                schedule(waiter.handle);
+            }
+
+            _waiters.erase(found);
         }
 
-        typename IIterator<T>::Ptr clone() override
+        void poll()
         {
-            return std::make_shared<TakeWhile<T>>(*this);
-        }
-    };
+            epoll_event events[64];
+            int n = ::epoll_wait(_epoll, events, 64, -1);
 
-    template <typename T>
-    class Skip : public IIterator<T>
-    {
-        typename IIterator<T>::Ptr _iter;
-        int _current;
-        int _count;
+            if (n < 0 && errno != EINTR)
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+
+            for (int i = 0; i < n; i++)
+                wake(events[i].data.fd, events[i].events);
+        }
 
       public:
-        Skip(const Skip& other) = default;
-        Skip(typename IIterator<T>::Ptr iter, int count) 
-            : _iter(iter)
-            , _current(0)
-            , _count(count)
+        EventLoop(const EventLoop& other) = delete;
+        EventLoop()
+            : _epoll(::epoll_create1(EPOLL_CLOEXEC))
+            , _waiting(0)
         {
+            if (_epoll < 0)
+                throw std::system_error(errno, std::generic_category(), "epoll_create1");
         }
 
-        T* next() override
+        ~EventLoop()
         {
-            while (auto item = _iter->next())
-            {
-                if (_current < _count)
-                    _current++;
-                else
-                    return item;
-            }
-
-            return nullptr;
+            ::close(_epoll);
         }
 
-        typename IIterator<T>::Ptr clone() override
+        // Loop running on this thread; only valid inside run()
+        static EventLoop& current()
         {
-            return std::make_shared<Skip<T>>(*this);
+            if (!current_ptr())
+                throw std::logic_error("EventLoop::current() called outside run()");
+
+            return *current_ptr();
         }
-    };
 
-    template <typename T>
-    class SkipWhile : public IIterator<T>
-    {
-        typename IIterator<T>::Ptr _iter;
-        std::function<bool(const T&)> _pred;
-        bool _done;
+        void schedule(std::coroutine_handle<> handle)
+        {
+            _ready.push_back(handle);
+        }
 
-      public:
-        SkipWhile(const SkipWhile& other) = default;
-        SkipWhile(typename IIterator<T>::Ptr iter, std::function<bool(const T&)> pred) 
-            : _iter(iter)
-            , _pred(pred)
-            , _done(false)
+        void spawn(Task<void> task)
         {
+            schedule(launch(std::move(task))._handle);
         }
 
-        T* next() override
+        // Runs until no coroutine is ready or waiting on a descriptor.
+        // Rethrows the first exception a spawned task let escape; the
+        // other tasks stay scheduled for the next run().
+        void run()
         {
-            while (auto item = _iter->next())
+            struct Current
             {
-                if (!_done)
+                EventLoop* previous;
+
+                ~Current()
                 {
-                    if (_pred(*item))
-                    {
-                        continue;
-                    }
-                    else
-                    {
-                        _done = true;
-                        return item;
-                    }
+                    current_ptr() = previous;
                 }
-                else
+            } current{std::exchange(current_ptr(), this)};
+
+            while (!_ready.empty() || _waiting > 0)
+            {
+                while (!_ready.empty())
                 {
-                    return item;
+                    auto handle = _ready.front();
+                    _ready.pop_front();
+                    handle.resume();
+
+                    if (_error)
+                        std::rethrow_exception(std::exchange(_error, nullptr));
                 }
+
+                if (_waiting > 0)
+                    poll();
             }
+        }
 
-            return nullptr;
+        template <typename T>
+        T block_on(Task<T> task)
+        {
+            if constexpr (std::is_void<T>::value)
+            {
+                spawn(std::move(task));
+                run();
+            }
+            else
+            {
+                std::optional<T> result;
+                spawn(store(std::move(task), result));
+                run();
+                return std::move(*result);
+            }
         }
 
-        typename IIterator<T>::Ptr clone() override
+        FdAwaiter readable(int fd)
+        {
+            return {*this, fd, EPOLLIN};
+        }
+
+        FdAwaiter writable(int fd)
+        {
+            return {*this, fd, EPOLLOUT};
+        }
+
+        YieldAwaiter yield()
         {
-            return std::make_shared<SkipWhile<T>>(*this);
+            return {*this};
         }
     };
 
     template <typename T>
-    class Filter : public IIterator<T>
+    class AsyncIterator;
+
+    template <typename Tin, typename Tout>
+    class AsyncMap;
+
+    template <typename T>
+    class AsyncFilter;
+
+    template <typename T>
+    class AsyncTake;
+
+    template <typename Tin, typename Tout>
+    class AsyncBufferUnordered;
+
+    template <typename T>
+    class AsyncIter;
+
+    class AsyncLines;
+
+    // Wraps a synchronous iterator as an asynchronous one
+    template <typename It>
+    auto async_iter(std::shared_ptr<It> iter)
     {
-        typename IIterator<T>::Ptr _iter;
-        std::function<bool(const T&)> _predicate;
+        return std::make_shared<AsyncIter<item_t<It>>>(iter);
+    }
 
-      public:
-        Filter(const Filter& other) = default;
-        Filter(typename IIterator<T>::Ptr iter, std::function<bool(const T&)>  predicate)
-            : _iter(iter)
-            , _predicate(predicate)
-        {
-        }
+    // Lines read from a pipe, socket or other descriptor, without blocking
+    // the loop; the descriptor is switched to non-blocking but not closed
+    auto async_lines(int fd)
+    {
+        return std::make_shared<AsyncLines>(fd);
+    }
 
-        T* next() override
+    // Like IIterator, but next() is awaited inside an EventLoop
+    template <typename T>
+    class AsyncIterator : public std::enable_shared_from_this<AsyncIterator<T>>
+    {
+        // Terminals keep the pipeline alive from a parameter, since a
+        // lazily started coroutine can outlive the expression creating it
+        template <typename Container>
+        static Task<Container> collect(std::shared_ptr<AsyncIterator> self)
         {
-            while(auto item = _iter->next())
-                if (_predicate(*item))
-                    return item;
+            Container cont;
 
-            return nullptr;
+            while (auto item = co_await self->next())
+                cont.insert(std::end(cont), *item);
+
+            co_return cont;
         }
 
-        typename IIterator<T>::Ptr clone() override
+        static Task<void> for_each(std::shared_ptr<AsyncIterator> self, SharedFunction<void(const T&)> fun)
         {
-            return std::make_shared<Filter<T>>(*this);
+            while (auto item = co_await self->next())
+                fun(*item);
         }
-    };
 
-    template <typename Tin, typename Tout>
-    class Map : public IIterator<Tout>
-    {
-        typename IIterator<Tin>::Ptr _iter;
-        Tout _result;
-        std::function<Tout(const Tin&)> _fun;
+        public:
+            using Ptr = std::shared_ptr<AsyncIterator>;
 
-      public:
-        Map(const Map& other) = default;
-        Map(typename IIterator<Tin>::Ptr iter, std::function<Tout(const Tin&)> fun)
-            : _iter(iter)
-            , _fun(fun)
-        {
-        }
+            virtual Task<T*> next() = 0;
+            virtual ~AsyncIterator(){};
 
-        Tout* next() override
-        {
-            if (auto item = _iter->next())
+            template <typename Tout>
+            auto map(std::function<Tout(const T&)> function)
             {
-                _result = _fun(*item);
-                return &_result;
+                return std::make_shared<AsyncMap<T, Tout>>(this->shared_from_this(), function);
             }
 
-            return nullptr;
-        }
+            auto filter(std::function<bool(const T&)> predicate)
+            {
+                return std::make_shared<AsyncFilter<T>>(this->shared_from_this(), predicate);
+            }
 
-        typename IIterator<Tout>::Ptr clone() override
-        {
-            return std::make_shared<Map<Tin,Tout>>(*this);
-        }
+            auto take(size_t count)
+            {
+                return std::make_shared<AsyncTake<T>>(this->shared_from_this(), count);
+            }
+
+            // Runs function on up to limit items concurrently and yields
+            // the results in completion order
+            template <typename Tout>
+            auto buffer_unordered(std::function<Task<Tout>(T)> function, size_t limit)
+            {
+                return std::make_shared<AsyncBufferUnordered<T, Tout>>(this->shared_from_this(), function, limit);
+            }
+
+            template <template <typename, typename...> class Container, typename... Args>
+            Task<Container<T, Args...>> collect()
+            {
+                return collect<Container<T, Args...>>(this->shared_from_this());
+            }
+
+            Task<void> for_each(std::function<void(const T&)> fun)
+            {
+                return for_each(this->shared_from_this(), fun);
+            }
     };
 
     template <typename T>
-    class Inspect : public IIterator<T>
+    class AsyncIter : public AsyncIterator<T>
     {
         typename IIterator<T>::Ptr _iter;
-        std::function<void(const T&)> _fun;
 
       public:
-        Inspect(const Inspect& other) = default;
-        Inspect(typename IIterator<T>::Ptr iter, std::function<void(const T&)> fun)
+        AsyncIter(typename IIterator<T>::Ptr iter)
             : _iter(iter)
-            , _fun(fun)
-        {
-        }
-
-        T* next() override
         {
-            if (auto item = _iter->next())
-            {
-                _fun(*item);
-                return item;
-            }
-
-            return nullptr;
         }
 
-        typename IIterator<T>::Ptr clone() override
+        Task<T*> next() override
         {
-            return std::make_shared<Inspect<T>>(*this);
+            co_return _iter->next();
         }
     };
 
-    template <typename Tin, typename Tout>
-    class FilterMap : public IIterator<Tout>
+    class AsyncLines : public AsyncIterator<std::string>
     {
-        typename IIterator<Tin>::Ptr _iter;
-        Tout _result;
-        std::function<std::optional<Tout>(const Tin&)> _fun;
+        static constexpr size_t chunk = 4096;
+
+        int _fd;
+        std::string _buffer;
+        size_t _pos;
+        bool _eof;
+        std::string _currentLine;
 
       public:
-        FilterMap(const FilterMap& other) = default;
-        FilterMap(typename IIterator<Tin>::Ptr iter, std::function<std::optional<Tout>(const Tin&)> fun)
-            : _iter(iter)
-            , _fun(fun)
+        AsyncLines(int fd)
+            : _fd(fd)
+            , _pos(0)
+            , _eof(false)
         {
+            ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
         }
 
-        Tout* next() override
+        Task<std::string*> next() override
         {
-            while (auto item = _iter->next())
+            while (true)
             {
-                if (auto res = _fun(*item))
+                auto newline = _buffer.find('\n', _pos);
+
+                if (newline != std::string::npos)
                 {
-                    _result = *res;
-                    return &_result;
+                    _currentLine.assign(_buffer, _pos, newline - _pos);
+                    _pos = newline + 1;
+                    co_return &_currentLine;
                 }
-            }
 
-            return nullptr;
-        }
+                if (_eof)
+                {
+                    if (_pos == _buffer.size())
+                        co_return nullptr;
 
-        typename IIterator<Tout>::Ptr clone() override
-        {
-            return std::make_shared<FilterMap<Tin,Tout>>(*this);
+                    _currentLine.assign(_buffer, _pos);
+                    _pos = _buffer.size();
+                    co_return &_currentLine;
+                }
+
+                _buffer.erase(0, _pos);
+                _pos = 0;
+
+                auto size = _buffer.size();
+                _buffer.resize(size + chunk);
+                auto n = ::read(_fd, &_buffer[size], chunk);
+                _buffer.resize(size + std::max<ssize_t>(n, 0));
+
+                if (n == 0)
+                    _eof = true;
+                else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    co_await EventLoop::current().readable(_fd);
+                else if (n < 0 && errno != EINTR)
+                    _eof = true;
+            }
         }
     };
 
     template <typename Tin, typename Tout>
-    class FlatMap : public IIterator<Tout>
+    class AsyncMap : public AsyncIterator<Tout>
     {
-        typename IIterator<Tin>::Ptr _iter;
+        typename AsyncIterator<Tin>::Ptr _iter;
+        SharedFunction<Tout(const Tin&)> _fun;
         Tout _result;
-        std::function<typename IIterator<Tout>::Ptr (const Tin&)> _fun;
-        typename IIterator<Tout>::Ptr _iterOut;
 
       public:
-        FlatMap(const FlatMap& other) = default;
-        FlatMap(typename IIterator<Tin>::Ptr iter,
-                std::function<typename IIterator<Tout>::Ptr(const Tin&)> fun)
+        AsyncMap(typename AsyncIterator<Tin>::Ptr iter, std::function<Tout(const Tin&)> fun)
             : _iter(iter)
             , _fun(fun)
-            , _iterOut(empty<Tout>())
         {
         }
 
-        Tout* next() override
+        Task<Tout*> next() override
         {
-            if (auto item = _iterOut->next())
-            {
-                return item;
-            }
-            else
+            if (auto item = co_await _iter->next())
             {
-                if (auto in = _iter->next())
-                {
-                    _iterOut = _fun(*in);
-                    return next();
-                }
-                else
-                {
-                    return nullptr;
-                }
+                _result = _fun(*item);
+                co_return &_result;
             }
-        }
 
-        typename IIterator<Tout>::Ptr clone() override
-        {
-            return std::make_shared<FlatMap<Tin,Tout>>(*this);
+            co_return nullptr;
         }
     };
 
-    template <typename Tfirst, typename Tsecond>
-    class Zip : public IIterator<std::pair<Tfirst, Tsecond> >
+    template <typename T>
+    class AsyncFilter : public AsyncIterator<T>
     {
-        typename IIterator<Tfirst>::Ptr _iter1;
-        typename IIterator<Tsecond>::Ptr _iter2;
-
-        using Pair = std::pair<Tfirst, Tsecond>;
-        Pair _result;
+        typename AsyncIterator<T>::Ptr _iter;
+        SharedFunction<bool(const T&)> _predicate;
 
       public:
-        Zip(const Zip& other) = default;
-        Zip(typename IIterator<Tfirst>::Ptr iter1, typename IIterator<Tsecond>::Ptr iter2)
-            : _iter1(iter1)
-            , _iter2(iter2)
+        AsyncFilter(typename AsyncIterator<T>::Ptr iter, std::function<bool(const T&)> predicate)
+            : _iter(iter)
+            , _predicate(predicate)
         {
         }
 
-        std::pair<Tfirst, Tsecond>* next() override
-        { 
-            if (auto item1 = _iter1->next())
-            if (auto item2 = _iter2->next())
-            {
-                _result = std::make_pair(*item1, *item2);
-                return &_result;
-            }
-
-            return nullptr;
-        }
-
-        typename IIterator<std::pair<Tfirst, Tsecond>>::Ptr clone() override
+        Task<T*> next() override
         {
-            return std::make_shared<Zip<Tfirst, Tsecond>>(*this);
+            while (auto item = co_await _iter->next())
+                if (_predicate(*item))
+                    co_return item;
+
+            co_return nullptr;
         }
     };
 
     template <typename T>
-    class Chain : public IIterator<T>
+    class AsyncTake : public AsyncIterator<T>
     {
-        typename IIterator<T>::Ptr _iter1;
-        typename IIterator<T>::Ptr _iter2;
-        bool _consumedFirst;
+        typename AsyncIterator<T>::Ptr _iter;
+        size_t _count;
 
       public:
-        Chain(const Chain& other) = default;
-        Chain(typename IIterator<T>::Ptr iter1, typename IIterator<T>::Ptr iter2)
-            : _iter1(iter1)
-            , _iter2(iter2)
-            , _consumedFirst(false)
+        AsyncTake(typename AsyncIterator<T>::Ptr iter, size_t count)
+            : _iter(iter)
+            , _count(count)
         {
         }
 
-        T* next() override
-        { 
-            if (!_consumedFirst)
-            {
-                if (auto item1 = _iter1->next())
-                    return item1;
-                else
-                    _consumedFirst = true;
-            }
+        Task<T*> next() override
+        {
+            if (_count == 0)
+                co_return nullptr;
 
-            if (_consumedFirst)
+            if (auto item = co_await _iter->next())
             {
-                if (auto item2 = _iter2->next())
-                    return item2;
+                _count--;
+                co_return item;
             }
 
-            return nullptr;
-        }
-
-        typename IIterator<T>::Ptr clone() override
-        {
-            return std::make_shared<Chain<T>>(*this);
+            co_return nullptr;
         }
     };
 
-    template <typename T>
-    class Cycle : public IIterator<T>
+    template <typename Tin, typename Tout>
+    class AsyncBufferUnordered : public AsyncIterator<Tout>
     {
-        typename IIterator<T>::Ptr _iterOrig;
-        typename IIterator<T>::Ptr _iter;
+        using Self = AsyncBufferUnordered<Tin, Tout>;
 
-      public:
-        Cycle(const Cycle& other) = default;
-        Cycle(typename IIterator<T>::Ptr iter)
-            : _iterOrig(iter)
-            , _iter(iter->clone())
+        struct Completion
         {
-        }
+            Self& _self;
 
-        T* next() override
-        { 
-            if (auto item = _iter->next())
+            bool await_ready() noexcept
             {
-                return item;
+                return false;
             }
-            else
+
+            void await_suspend(std::coroutine_handle<> handle) noexcept
             {
-                _iter = _iterOrig->clone();
-                return next();
+                _self._waiter = handle;
             }
-        }
 
-        typename IIterator<T>::Ptr clone() override
+            void await_resume() noexcept
+            {
+            }
+        };
+
+        typename AsyncIterator<Tin>::Ptr _iter;
+        SharedFunction<Task<Tout>(Tin)> _fun;
+        size_t _limit;
+        size_t _inFlight;
+        bool _exhausted;
+        std::deque<Tout> _done;
+        std::coroutine_handle<> _waiter;
+        std::optional<Tout> _result;
+
+        static Task<void> run(std::shared_ptr<Self> self, Tin item)
         {
-            return std::make_shared<Cycle<T>>(*this);
-        }
-    };
+            auto result = co_await self->_fun(std::move(item));
+            self->_done.push_back(std::move(result));
+            self->_inFlight--;
 
-    template <typename T>
-    class Fuse : public IIterator<T>
-    {
-        typename IIterator<T>::Ptr _iter;
-        bool _done;
+            if (auto waiter = std::exchange(self->_waiter, {}))
+                EventLoop::current().schedule(waiter);
+        }
 
       public:
-        Fuse(const Fuse& other) = default;
-        Fuse(typename IIterator<T>::Ptr iter)
+        AsyncBufferUnordered(typename AsyncIterator<Tin>::Ptr iter,
+                             std::function<Task<Tout>(Tin)> fun,
+                             size_t limit)
             : _iter(iter)
-            , _done(false)
+            , _fun(fun)
+            , _limit(std::max<size_t>(limit, 1))
+            , _inFlight(0)
+            , _exhausted(false)
         {
         }
 
-        T* next() override
-        { 
-            if (!_done)
+        Task<Tout*> next() override
+        {
+            while (true)
             {
-                if (auto item = _iter->next())
+                while (!_exhausted && _inFlight < _limit)
                 {
-                    return item;
+                    auto item = co_await _iter->next();
+
+                    if (!item)
+                    {
+                        _exhausted = true;
+                        break;
+                    }
+
+                    _inFlight++;
+                    auto self = std::static_pointer_cast<Self>(this->shared_from_this());
+                    EventLoop::current().spawn(run(self, *item));
                 }
-                else
+
+                if (!_done.empty())
                 {
-                    _done = true;
-                    return nullptr;
+                    _result.emplace(std::move(_done.front()));
+                    _done.pop_front();
+                    co_return &*_result;
                 }
-            }
-            else
-            {
-                return nullptr;
-            }
-        }
-
-        typename IIterator<T>::Ptr clone() override
-        {
-            return std::make_shared<Fuse<T>>(*this);
-        }
-    };
-
-    template <typename Tin, typename Tout>
-    class Scan : public IIterator<Tout>
-    {
-        typename IIterator<Tin>::Ptr _iter;
-        Tout _result;
-        std::function<Tout(const Tout&, const Tin&)> _fun;
 
-      public:
-        Scan(const Scan& other) = default;
-        Scan(typename IIterator<Tin>::Ptr iter,
-                const Tout& init,
-                std::function<Tout(const Tout&, const Tin&)> fun)
-            : _iter(iter)
-            , _result(init)
-            , _fun(fun)
-        {
-        }
+                if (_inFlight == 0)
+                    co_return nullptr;
 
-        Tout* next() override
-        {
-            if (auto item = _iter->next())
-            {
-                _result = _fun(_result, *item);
-                return &_result;
+                co_await Completion{*this};
             }
-
-            return nullptr;
-        }
-
-        typename IIterator<Tout>::Ptr clone() override
-        {
-            return std::make_shared<Scan<Tin,Tout>>(*this);
         }
     };
+#endif
+#endif
 
 } // ri namespace
@@ -3,9 +3,20 @@
 #include <optional>
 #include <vector>
 #include <chrono>
+#include <fstream>
+#include <list>
+#include <numeric>
+#include <thread>
 #include "catch.hpp"
 #include "ri.h"
 
+// Temporary file path no other test or concurrent run uses
+static ri::fs::path unique_temp_path(const std::string& name)
+{
+    static std::atomic<int> counter(0);
+    auto unique = std::to_string(::getpid()) + "_" + std::to_string(counter++) + "_" + name;
+    return ri::fs::temp_directory_path() / unique;
+}
 
 // Tests generated from Rust documentation
 // https://doc.rust-lang.org/std/iter/trait.Iterator.html
@@ -45,6 +56,24 @@ TEST_CASE("cycle")
     REQUIRE(*iter->next() == 3);
 }
 
+TEST_CASE("cycle with buffer")
+{
+    std::vector<int> a{1, 2, 3};
+    int pulls = 0;
+
+    auto iter = ri::iter(a)->inspect([&](auto) { pulls++; })->cycle(16);
+
+    REQUIRE(iter->take(7)->collect<std::vector>() == std::vector<int>{1, 2, 3, 1, 2, 3, 1});
+    REQUIRE(pulls == 3);
+
+    // Too small a buffer falls back to re-running the source
+    auto small = ri::iter(a)->cycle(2);
+    REQUIRE(small->take(7)->collect<std::vector>() == std::vector<int>{1, 2, 3, 1, 2, 3, 1});
+
+    REQUIRE(!ri::empty<int>()->cycle()->next());
+    REQUIRE(!ri::empty<int>()->cycle(4)->next());
+}
+
 TEST_CASE("sum")
 {
     std::vector<int> a{1, 2, 3};
@@ -92,6 +121,37 @@ TEST_CASE("nth")
     REQUIRE(!it->nth(1));
 }
 
+TEST_CASE("exact size shortcuts")
+{
+    std::vector<int> a {1, 2, 3};
+    int calls = 0;
+    auto counted = [&](auto x) { calls++; return x * 10; };
+
+    REQUIRE(ri::iter(a)->map<int>(counted)->count() == 3);
+    REQUIRE(*ri::iter(a)->map<int>(counted)->last() == 30);
+    REQUIRE(*ri::iter(a)->map<int>(counted)->nth(1) == 20);
+    REQUIRE(calls == 2);
+
+    REQUIRE(ri::repeat(7)->take(5)->count() == 5);
+    REQUIRE(ri::once(7)->count() == 1);
+    REQUIRE(ri::empty<int>()->count() == 0);
+    REQUIRE(*ri::repeat(7)->take(5)->last() == 7);
+
+    auto filled = ri::repeat('x')->take(4)->collect<std::vector>();
+    REQUIRE(filled == std::vector<char>{'x', 'x', 'x', 'x'});
+
+    // Infinite sources give no upper bound, but take() is still exact
+    REQUIRE(ri::repeat(7)->size_hint() == std::make_pair(size_t(1), std::optional<size_t>()));
+    REQUIRE(ri::gen(0.5)->map<double>([](auto x) { return x; })->size_hint().first == 0);
+    REQUIRE(ri::gen(0.5)->take(3)->size_hint() == std::make_pair(size_t(3), std::optional<size_t>(3)));
+    REQUIRE(ri::gen(0.5)->zip<int>(ri::iter(a))->size_hint() == std::make_pair(size_t(3), std::optional<size_t>(3)));
+
+    auto it = ri::iter(a)->skip(1);
+    REQUIRE(it->size_hint() == std::make_pair(size_t(2), std::optional<size_t>(2)));
+    REQUIRE(it->count() == 2);
+    REQUIRE(!it->next());
+}
+
 TEST_CASE("chain")
 {
     std::vector<int> a1 = {1, 2, 3};
@@ -121,6 +181,39 @@ TEST_CASE("zip")
     REQUIRE(!iter->next());
 }
 
+TEST_CASE("zip n-ary")
+{
+    std::vector<int> a = {1, 2, 3, 4};
+    std::vector<std::string> b = {"a", "b", "c"};
+    std::vector<double> c = {0.5, 1.5, 2.5, 3.5, 4.5};
+
+    auto indexed = ri::zip(ri::iter(a), ri::iter(b), ri::iter(c));
+
+    REQUIRE(std::dynamic_pointer_cast<ri::ZipIndexed<std::vector<int>, std::vector<std::string>, std::vector<double>>>(
+                std::static_pointer_cast<ri::IIterator<std::tuple<int&, std::string&, double&>>>(indexed)));
+    REQUIRE(indexed->size_hint() == std::make_pair(size_t(3), std::optional<size_t>(3)));
+
+    auto& [x, s, d] = *indexed->next();
+
+    REQUIRE(&x == &a[0]);
+    REQUIRE(&s == &b[0]);
+    REQUIRE(&d == &c[0]);
+    REQUIRE(indexed->count() == 2);
+
+    auto mixed = ri::zip(ri::gen(10, 20), ri::iter(b), ri::iter(a)->skip(1));
+
+    REQUIRE(mixed->size_hint() == std::make_pair(size_t(3), std::optional<size_t>(3)));
+
+    auto& [n, t, y] = *mixed->next();
+
+    REQUIRE(n == 10);
+    REQUIRE(&t == &b[0]);
+    REQUIRE(&y == &a[1]);
+    REQUIRE(std::get<0>(*mixed->next()) == 11);
+    REQUIRE(std::get<0>(*mixed->next()) == 12);
+    REQUIRE(!mixed->next());
+}
+
 TEST_CASE("map")
 {   
     std::vector<int> a = {1, 2, 3};
@@ -147,6 +240,97 @@ TEST_CASE("scan")
     REQUIRE(!iter->next());
 }
 
+TEST_CASE("parallel plan")
+{
+    std::vector<int> small = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+    auto cheap = [](const int&) {};
+
+    REQUIRE(ri::iter(small)->plan_parallel(0, cheap).threads == 1);
+    REQUIRE(ri::iter(small)->plan_parallel(3, cheap).threads == 3);
+    REQUIRE(ri::gen(0)->take(10)->plan_parallel(0, cheap).threads == 1);
+
+    // Unless measuring, per_item and upstream never run early
+    int calls = 0;
+    auto counted = [&](const int&) { calls++; };
+
+    REQUIRE(ri::gen(0, 100000)->inspect(counted)->plan_parallel(0, counted).threads == 1);
+    REQUIRE(calls == 0);
+
+    // Items measured to be expensive are worth every core
+    auto sleepy = [](const int&) { std::this_thread::sleep_for(std::chrono::microseconds(200)); };
+    auto slow = ri::gen(0, 1000)->plan_parallel(0, sleepy, ri::ItemCost::measured);
+
+    REQUIRE(slow.threads == ri::worker_count(0));
+    REQUIRE(slow.grain >= 1);
+
+    // Unknown sizes run sequentially, unless measuring shows the prefix
+    // alone is worth the threads
+    auto unsized = [] { return ri::gen(0)->take_while([](auto x) { return x < 1000; }); };
+
+    REQUIRE(unsized()->plan_parallel(0, cheap).threads == 1);
+    REQUIRE(unsized()->plan_parallel(0, sleepy, ri::ItemCost::measured).threads >= std::min<size_t>(2, ri::worker_count(0)));
+
+    // Probing doesn't consume the iterator
+    auto it = ri::iter(small);
+    it->plan_parallel(0, counted, ri::ItemCost::measured);
+    REQUIRE(calls > 0);
+    REQUIRE(it->count() == 10);
+
+    auto add = [](const int& acc, const int& x) { return acc + x; };
+    REQUIRE(ri::iter(small)->par_reduce<int>(0, add, add) == 55);
+    REQUIRE(ri::iter(small)->par_collect() == small);
+    REQUIRE(*ri::iter(small)->par_position([](auto x) { return x == 7; }) == 6);
+}
+
+TEST_CASE("sum_precise")
+{
+    // Each triple sums to 1, but naive summation loses the 1
+    std::vector<double> v;
+
+    for (int i = 0; i < 30000; i++)
+    {
+        v.push_back(1e16);
+        v.push_back(1.0);
+        v.push_back(-1e16);
+    }
+
+    REQUIRE(ri::iter(v)->sum() == 0.0);
+    REQUIRE(ri::iter(v)->sum_precise() == 30000.0);
+
+    // Bit-identical whatever the thread count or source
+    std::vector<double> noisy;
+
+    for (int i = 0; i < 100000; i++)
+        noisy.push_back(std::sin(i) * std::pow(10.0, i % 17 - 8));
+
+    auto expected = ri::iter(noisy)->sum_precise(1);
+    std::list<double> list(noisy.begin(), noisy.end());
+
+    for (size_t threads : {2, 3, 7})
+        REQUIRE(ri::iter(noisy)->sum_precise(threads) == expected);
+
+    REQUIRE(ri::iter(list)->sum_precise(4) == expected);
+    REQUIRE(ri::iter(noisy)->filter([](auto) { return true; })->sum_precise() == expected);
+
+    REQUIRE(ri::empty<double>()->sum_precise() == 0.0);
+    REQUIRE(ri::gen(1, 101)->sum_precise() == 5050);
+}
+
+TEST_CASE("par_scan")
+{
+    auto plus = [](const long& a, const long& b) { return a + b; };
+
+    std::vector<long> v = ri::gen(0L, 100000L)->map<long>([](auto x) { return x % 7; })->collect<std::vector>();
+
+    auto expected = ri::iter(v)->scan<long>(5, plus)->collect<std::vector>();
+
+    REQUIRE(ri::iter(v)->par_scan(5, plus, 4) == expected);
+    REQUIRE(ri::iter(v)->par_scan(5, plus) == expected);
+    REQUIRE(ri::iter(v)->take(100000)->par_scan(5, plus) == expected);
+    REQUIRE(ri::gen(0, 3)->par_scan(0, [](auto a, auto b) { return std::max(a, b); }, 8) == std::vector<int>{0, 1, 2});
+    REQUIRE(ri::empty<int>()->par_scan(0, [](auto a, auto b) { return a + b; }).empty());
+}
+
 TEST_CASE("for_each")
 {
     int i = 0;
@@ -169,6 +353,115 @@ TEST_CASE("filter")
     REQUIRE(!iter->next());
 }
 
+TEST_CASE("batched filter")
+{
+    auto check = [](auto values, auto threshold) {
+        using T = typename decltype(values)::value_type;
+
+        std::list<T> linked(values.begin(), values.end());
+
+        for (auto comparison : {ri::less(threshold), ri::less_equal(threshold), ri::greater(threshold),
+                 ri::greater_equal(threshold), ri::equal_to(threshold), ri::not_equal_to(threshold)})
+        {
+            std::vector<T> expected;
+
+            for (auto x : values)
+                if (comparison(x))
+                    expected.push_back(x);
+
+            auto batched = ri::iter(values)->filter(comparison);
+
+            REQUIRE(std::dynamic_pointer_cast<ri::BatchFilter<T>>(batched));
+            REQUIRE(batched->template collect<std::vector<T>>() == expected);
+            REQUIRE(ri::iter(linked)->filter(comparison)->template collect<std::vector<T>>() == expected);
+        }
+    };
+
+    for (size_t n : {0, 1, 7, 8, 17, 1000, 3001})
+    {
+        std::vector<int> ints(n);
+        std::vector<long> longs(n);
+        std::vector<float> floats(n);
+        std::vector<double> doubles(n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            ints[i] = int(i * 7919 % 13) - 6;
+            longs[i] = long(i * 7919 % 13) - 6;
+            floats[i] = float(i * 7919 % 13) / 2;
+            doubles[i] = double(i * 7919 % 13) / 2;
+        }
+
+        check(ints, 0);
+        check(longs, 0L);
+        check(floats, 3.0f);
+        check(doubles, 3.0);
+    }
+
+    std::vector<int> a = {5, 1, 7, 3, 9};
+
+    auto iter = ri::iter(a)->filter(ri::greater(4));
+    auto copy = iter->clone();
+
+    REQUIRE(*iter->next() == 5);
+    REQUIRE(iter->collect<std::vector<int>>() == std::vector<int>{7, 9});
+    REQUIRE(copy->collect<std::vector<int>>() == std::vector<int>{5, 7, 9});
+
+    // A value that doesn't fit the item type compares as a predicate
+    auto fallback = ri::iter(a)->filter(ri::greater(4.5));
+
+    REQUIRE(!std::dynamic_pointer_cast<ri::BatchFilter<int>>(fallback));
+    REQUIRE(fallback->collect<std::vector<int>>() == std::vector<int>{5, 7, 9});
+
+    std::vector<double> b = {1.0, std::nan(""), 3.0};
+
+    REQUIRE(ri::iter(b)->filter(ri::less(2.0))->count() == 1);
+    REQUIRE(ri::iter(b)->filter(ri::not_equal_to(1.0))->count() == 2);
+}
+
+TEST_CASE("fused adapters")
+{
+    std::vector<int> a = {1, 2, 3, 4, 5, 6};
+    std::vector<int> seen;
+
+    auto iter = ri::iter(a)
+        ->filter([](auto x) { return x % 2 == 0; })
+        ->map<int>([](auto x) { return x * 10; })
+        ->inspect([&](auto x) { seen.push_back(x); })
+        ->filter([](auto x) { return x != 40; })
+        ->map<std::string>([](auto x) { return std::to_string(x); })
+        ->map<std::string>([](auto s) { return s + "!"; });
+
+    auto fused = std::dynamic_pointer_cast<ri::Fused<int, std::string>>(iter);
+
+    REQUIRE(fused);
+    REQUIRE(fused->stages() == "filter -> map -> inspect -> filter -> map -> map");
+    REQUIRE(*iter->next() == "20!");
+    REQUIRE(*iter->next() == "60!");
+    REQUIRE(!iter->next());
+    REQUIRE(seen == std::vector<int>{20, 40, 60});
+
+    auto single = ri::iter(a)->filter([](auto x) { return x > 3; });
+    REQUIRE(std::dynamic_pointer_cast<ri::Filter<int>>(single));
+
+    auto mapped = ri::gen(0, 6)
+        ->map<int>([](auto x) { return x + 1; })
+        ->map<std::string>([](auto x) { return std::to_string(x); });
+    auto part = mapped->slice(1, 3);
+
+    REQUIRE(part->collect<std::vector>() == std::vector<std::string>{"2", "3"});
+    REQUIRE(mapped->split()->collect<std::vector>() == std::vector<std::string>{"4", "5", "6"});
+    REQUIRE(mapped->collect<std::vector>() == std::vector<std::string>{"1", "2", "3"});
+
+    auto filtered = ri::gen(0, 6)
+        ->map<int>([](auto x) { return x + 1; })
+        ->filter([](auto x) { return x % 2 == 0; });
+
+    REQUIRE(!filtered->slice(0, 2));
+    REQUIRE(filtered->split()->collect<std::vector>() == std::vector<int>{4, 6});
+    REQUIRE(filtered->collect<std::vector>() == std::vector<int>{2});
+}
+
 TEST_CASE("filter_map")
 {
     std::vector<std::string> a = {"1", "lol", "3", "NaN", "5"};
@@ -199,10 +492,21 @@ TEST_CASE("enumerate")
 
     auto iter = ri::iter(a)->enumerate();
 
-    REQUIRE(*iter->next() == std::make_pair(size_t(0), 'a'));
-    REQUIRE(*iter->next() == std::make_pair(size_t(1), 'b'));
-    REQUIRE(*iter->next() == std::make_pair(size_t(2), 'c'));
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        auto item = iter->next();
+
+        REQUIRE(item->first == i);
+        REQUIRE(&item->second == &a[i]);
+    }
+
     REQUIRE(!iter->next());
+
+    auto front = ri::gen(0, 5)->enumerate();
+    auto back = front->split();
+
+    REQUIRE(front->count() == 2);
+    REQUIRE(back->next()->first == 2);
 }
 
 //TODO Peekable
@@ -261,6 +565,45 @@ TEST_CASE("generator")
     REQUIRE(!iter->next());
 }
 
+TEST_CASE("range")
+{
+    auto r = ri::gen(0, 3, 10);
+
+    REQUIRE(r->size_hint() == std::make_pair(size_t(4), std::optional<size_t>(4)));
+    REQUIRE(ri::gen(0, 3, 10)->count() == 4);
+    REQUIRE(ri::gen(0, 3, 10)->sum() == 0 + 3 + 6 + 9);
+    REQUIRE(*ri::gen(0, 3, 10)->last() == 9);
+    REQUIRE(*ri::gen(0, 3, 10)->nth(2) == 6);
+    REQUIRE(!ri::gen(0, 3, 10)->nth(4));
+    REQUIRE(*ri::gen(0, 10)->skip(7)->next() == 7);
+
+    // skip() is lazy and shares its upstream like any other adapter
+    auto upstream = ri::gen(0, 10);
+    auto skipped = upstream->skip(3);
+    REQUIRE(*upstream->next() == 0);
+    REQUIRE(*skipped->next() == 4);
+
+    REQUIRE(ri::gen(5, 5)->count() == 0);
+    REQUIRE(ri::gen(5, 1)->count() == 0);
+    REQUIRE(ri::gen(-5, 5)->sum() == -5);
+    REQUIRE(ri::gen(5, -1, 0)->count() == 0);
+    REQUIRE_THROWS_AS(ri::gen(0, 0, 10), std::invalid_argument);
+    REQUIRE_THROWS_AS(ri::gen(0, -1, 10), std::invalid_argument);
+    REQUIRE(ri::gen<int64_t>(0, 1000000)->sum() == int64_t(999999) * 1000000 / 2);
+
+    auto rev = ri::gen(0, 4)->rev();
+
+    REQUIRE(*rev->next() == 3);
+    REQUIRE(*rev->next() == 2);
+    REQUIRE(rev->collect<std::vector>() == std::vector<int>{1, 0});
+
+    auto front = ri::gen(0, 5);
+    auto back = front->split();
+
+    REQUIRE(front->collect<std::vector>() == std::vector<int>{0, 1});
+    REQUIRE(back->collect<std::vector>() == std::vector<int>{2, 3, 4});
+}
+
 TEST_CASE("flat_map")
 {
     std::vector<int> a { 1, 2, 3 };
@@ -277,6 +620,88 @@ TEST_CASE("flat_map")
     REQUIRE(!m->next());
 }
 
+TEST_CASE("flat_map over empty expansions")
+{
+    auto m = ri::gen(0, 1000000)->flat_map<int>([](auto x) -> ri::IIterator<int>::Ptr
+            {
+                if (x % 500000 == 1)
+                    return ri::once(x);
+                else
+                    return ri::empty<int>();
+            });
+
+    REQUIRE(m->collect<std::vector>() == std::vector<int>{1, 500001});
+
+    auto nulls = ri::gen(0, 10)->flat_map<int>([](auto x) -> ri::IIterator<int>::Ptr
+            {
+                return x == 4 ? ri::once(x) : nullptr;
+            });
+
+    REQUIRE(nulls->collect<std::vector>() == std::vector<int>{4});
+}
+
+TEST_CASE("par_flat_map")
+{
+    // One huge expansion among many small ones
+    auto expand = [](const int& x) -> ri::IIterator<int>::Ptr {
+        return ri::gen(0, x == 3 ? 200000 : x);
+    };
+
+    auto expected = ri::gen(0, 64)->flat_map<int>(expand)->collect<std::vector>();
+    auto items = ri::gen(0, 64)->par_flat_map<int>(expand, 4)->collect<std::vector>();
+
+    std::sort(expected.begin(), expected.end());
+    std::sort(items.begin(), items.end());
+    REQUIRE(items == expected);
+
+    std::vector<int> v = {5, 0, 2};
+    REQUIRE(ri::iter(v)->par_flat_map<int>(expand)->count() == 7);
+    REQUIRE(ri::empty<int>()->par_flat_map<int>(expand, 2)->count() == 0);
+
+    // Dropping it early stops the workers
+    REQUIRE(*ri::gen(1)->par_flat_map<int>([](const int& x) -> ri::IIterator<int>::Ptr {
+        return ri::once(x);
+    }, 3)->nth(10) > 0);
+
+    auto failing = ri::gen(0, 100)->par_flat_map<int>([](const int& x) -> ri::IIterator<int>::Ptr {
+        if (x == 50)
+            throw std::runtime_error("fifty");
+        return ri::once(x);
+    }, 2);
+
+    REQUIRE_THROWS_AS(failing->count(), std::runtime_error);
+
+    // Workers stopped by the error still report that they are done
+    failing->count();
+
+    // nullptr expands to nothing
+    auto odd = [](const int& x) -> ri::IIterator<int>::Ptr {
+        return x % 2 ? ri::once(x) : nullptr;
+    };
+
+    REQUIRE(ri::gen(0, 1000)->par_flat_map<int>(odd, 3)->count() == 500);
+
+    // Large container expansions are split between threads too
+    std::vector<int> big = ri::gen(0, 100000)->collect<std::vector>();
+    auto whole = [&](const int&) -> ri::IIterator<int>::Ptr { return ri::iter(big); };
+
+    REQUIRE(ri::iter(big)->split());
+    REQUIRE(ri::gen(0, 4)->par_flat_map<int>(whole, 4)->count() == 400000);
+}
+
+TEST_CASE("flat_map_into")
+{
+    std::vector<int> a { 1, 0, 2, 0, 0, 3 };
+
+    auto m = ri::iter(a)->flat_map_into<int>([](auto x, auto& out)
+            {
+                for (int i = 0; i < x; i++)
+                    out.push_back(x * 10 + i);
+            });
+
+    REQUIRE(m->collect<std::vector>() == std::vector<int>{10, 20, 21, 30, 31, 32});
+}
+
 TEST_CASE("collect")
 {
     std::vector<std::string> b { "test", "hello", "world", "aloha" };
@@ -292,6 +717,43 @@ TEST_CASE("collect")
 }
 
 
+TEST_CASE("par_collect")
+{
+    auto triple = [](const int& x) { return x * 3; };
+    auto odd = [](const int& x) { return x % 2 == 1; };
+
+    std::vector<int> v = ri::gen(0, 100000)->collect<std::vector>();
+
+    REQUIRE(ri::iter(v)->par_collect(4) == v);
+    REQUIRE(ri::iter(v)->map<int>(triple)->par_collect(3) ==
+            ri::iter(v)->map<int>(triple)->collect<std::vector>());
+
+    // Filtered sources don't know their size, so they go through segments
+    REQUIRE(ri::gen(0, 100000)->filter(odd)->par_collect(4) ==
+            ri::gen(0, 100000)->filter(odd)->collect<std::vector>());
+    REQUIRE(ri::gen(0, 100000)->filter([](auto x) { return x > 99990; })->par_collect(8) ==
+            std::vector<int>{99991, 99992, 99993, 99994, 99995, 99996, 99997, 99998, 99999});
+
+    // Filters over containers split with the container
+    REQUIRE(ri::iter(v)->filter(odd)->split_into(4).size() == 4);
+    REQUIRE(ri::iter(v)->filter(odd)->par_collect(4) ==
+            ri::iter(v)->filter(odd)->collect<std::vector>());
+
+    std::list<int> l(v.begin(), v.begin() + 100);
+    REQUIRE(!ri::iter(l)->split());
+    REQUIRE(ri::iter(l)->filter(odd)->par_collect(4) == ri::iter(l)->filter(odd)->collect<std::vector>());
+
+    REQUIRE(ri::gen(0)->take(1000)->par_collect(4) == ri::gen(0, 1000)->collect<std::vector>());
+    REQUIRE(ri::empty<int>()->par_collect().empty());
+
+    auto path = unique_temp_path("ri_par_collect_test.txt");
+    std::ofstream(path.string()) << "a\nbb\n\nccc\nd\ne\nf\ngg\n";
+
+    REQUIRE(ri::lines(path)->par_collect(4) == ri::lines(path)->collect<std::vector>());
+
+    ri::fs::remove(path);
+}
+
 TEST_CASE("partition")
 {
     std::vector<int> a = {-1, -2, 0, 1, 2, -3};
@@ -306,6 +768,22 @@ TEST_CASE("partition")
     REQUIRE(pos[2] == 2);
 }
 
+TEST_CASE("unzip")
+{
+    std::vector<std::pair<int, char>> a = {{1, 'a'}, {2, 'b'}, {3, 'c'}};
+
+    auto [left, right] = ri::iter(a)->unzip<std::vector>();
+
+    REQUIRE(left == std::vector<int>{1, 2, 3});
+    REQUIRE(right == std::vector<char>{'a', 'b', 'c'});
+
+    std::vector<std::string> names = {"x", "y"};
+    auto [indices, copies] = ri::iter(names)->enumerate()->unzip<std::vector<size_t>, std::vector<std::string>>();
+
+    REQUIRE(indices == std::vector<size_t>{0, 1});
+    REQUIRE(copies == names);
+}
+
 TEST_CASE("fold")
 {
     std::vector<int> a = {1, 2, 3};
@@ -313,6 +791,81 @@ TEST_CASE("fold")
     auto sum = ri::iter(a)->fold<int>(0, [](auto acc, auto x) { return acc + x; });
 
     REQUIRE(sum == 6);
+
+    auto total = ri::iter(a)->fold<long>(0, [](long acc, int x) { return acc + x; });
+
+    REQUIRE(total == 6L);
+}
+
+TEST_CASE("par_reduce")
+{
+    auto add = [](const long& acc, const int& x) { return acc + x; };
+    auto plus = [](const long& a, const long& b) { return a + b; };
+
+    std::vector<int> v = ri::gen(0, 100000)->collect<std::vector>();
+    long expected = std::accumulate(v.begin(), v.end(), 0L);
+
+    REQUIRE(ri::iter(v)->par_reduce<long>(0, add, plus, 4) == expected);
+    REQUIRE(ri::gen(0, 100000)->par_reduce<long>(0, add, plus) == expected);
+    REQUIRE(ri::gen(0)->take(100000)->par_reduce<long>(0, add, plus, 3, true) == expected);
+    REQUIRE(ri::empty<int>()->par_reduce<long>(0, add, plus) == 0);
+
+    // Partial results are combined in order
+    auto digits = ri::gen(0, 1000)->map<std::string>([](auto x) { return std::to_string(x % 10); })
+        ->par_reduce<std::string>("",
+            [](const std::string& acc, const std::string& x) { return acc + x; },
+            [](const std::string& a, const std::string& b) { return a + b; }, 8);
+
+    REQUIRE(digits.size() == 1000);
+    REQUIRE(digits.substr(0, 12) == "012345678901");
+    REQUIRE(digits.substr(990) == "0123456789");
+
+    // Fused chains split like their source, and sources that can't be
+    // split fold in order unless combine is declared commutative
+    auto concat = [](const std::string& acc, const std::string& x) {
+        std::this_thread::yield();
+        return acc + x;
+    };
+    auto join = [](const std::string& a, const std::string& b) { return a + b; };
+    auto digit = [](auto x) { return std::to_string(x % 10); };
+    std::string expectedDigits;
+
+    for (int i = 0; i < 2000; i++)
+        expectedDigits += digit(i);
+
+    auto fused = ri::gen(0, 2000)
+        ->map<int>([](auto x) { return x + 10; })
+        ->map<std::string>(digit);
+
+    REQUIRE(std::dynamic_pointer_cast<ri::Fused<int, std::string>>(fused));
+    REQUIRE(fused->par_reduce<std::string>("", concat, join, 4) == expectedDigits);
+    REQUIRE(ri::gen(0)->take(2000)->map<std::string>(digit)
+        ->par_reduce<std::string>("", concat, join, 4) == expectedDigits);
+
+    auto path = unique_temp_path("ri_par_reduce_test.txt");
+    {
+        std::ofstream out(path.string());
+
+        for (int i = 0; i < 1000; i++)
+            out << i << "\n";
+    }
+
+    auto lineSum = ri::lines(path)->par_reduce<long>(0,
+        [](const long& acc, const std::string& line) { return acc + std::stol(line); }, plus, 4);
+
+    REQUIRE(lineSum == 999L * 1000 / 2);
+
+    auto parts = ri::lines(path)->split_into(4);
+    REQUIRE(parts.size() == 4);
+
+    long lines = 0;
+
+    for (auto& part : parts)
+        lines += part->count();
+
+    REQUIRE(lines == 1000);
+
+    ri::fs::remove(path);
 }
 
 
@@ -350,6 +903,80 @@ TEST_CASE("position")
     REQUIRE(!iter->position([](auto x) { return x == 1389; }));
 }
 
+TEST_CASE("parallel search")
+{
+    std::vector<int> v(200000, 0);
+    v[150000] = 1;
+    v[70001] = 1;
+    v[199999] = 2;
+
+    auto isOne = [](const int& x) { return x == 1; };
+
+    REQUIRE(*ri::iter(v)->par_position(isOne, 4) == 70001);
+    REQUIRE(*ri::iter(v)->par_position(isOne) == 70001);
+    REQUIRE(!ri::iter(v)->par_position([](auto x) { return x == 3; }, 4));
+    REQUIRE(ri::iter(v)->par_find(isOne, 4) == &v[70001]);
+    REQUIRE(!ri::iter(v)->par_find([](auto x) { return x < 0; }, 4));
+
+    // Leaves the iterator past the match, like position()
+    auto it = ri::iter(v);
+    REQUIRE(*it->par_position(isOne, 3) == 70001);
+    REQUIRE(*it->position(isOne) == 150000 - 70002);
+
+    REQUIRE(ri::iter(v)->par_any([](auto x) { return x == 2; }, 4));
+    REQUIRE(!ri::iter(v)->par_any([](auto x) { return x == 3; }, 4));
+    REQUIRE(ri::iter(v)->par_all([](auto x) { return x < 3; }, 4));
+    REQUIRE(!ri::iter(v)->par_all([](auto x) { return x == 0; }, 4));
+
+    REQUIRE(*ri::gen(0, 1000000)->par_position([](auto x) { return x % 99991 == 99990; }, 4) == 99990);
+    REQUIRE(*ri::gen(0, 1000000)->map<int>([](auto x) { return x * 2; })
+        ->par_find([](auto x) { return x > 1000; }, 4) == 1002);
+
+    // Sources that can't be sliced
+    REQUIRE(*ri::gen(0)->par_position([](auto x) { return x == 1234; }, 4) == 1234);
+    REQUIRE(ri::gen(0)->par_any([](auto x) { return x == 1234; }, 4));
+    REQUIRE(!ri::gen(0)->take(5000)->par_all([](auto x) { return x < 4999; }, 4));
+}
+
+TEST_CASE("counts and group_by")
+{
+    std::vector<int> a = {3, 1, 3, 2, 3, 1};
+
+    auto counts = ri::iter(a)->counts();
+    REQUIRE(counts.size() == 3);
+    REQUIRE(counts[3] == 3);
+    REQUIRE(counts[1] == 2);
+
+    auto groups = ri::iter(a)->group_by<bool>([](auto x) { return x % 2 == 1; });
+    REQUIRE(groups[true] == std::vector<int>{3, 1, 3, 3, 1});
+    REQUIRE(groups[false] == std::vector<int>{2});
+}
+
+TEST_CASE("par_counts and par_group_by")
+{
+    std::vector<int> events;
+
+    for (int i = 0; i < 200000; i++)
+        events.push_back((i * 7919) % 5003);
+
+    auto expected = ri::iter(events)->counts();
+
+    REQUIRE(ri::iter(events)->par_counts(4) == expected);
+    REQUIRE(ri::iter(events)->par_counts() == expected);
+    REQUIRE(ri::gen(0)->take(200000)->map<int>([](auto i) { return (i * 7919) % 5003; })->par_counts(3) == expected);
+    REQUIRE(ri::iter(events)->par_counts(4).size() == 5003);
+    REQUIRE(ri::empty<int>()->par_counts(4).empty());
+
+    auto byDigit = [](const int& x) { return x % 10; };
+    REQUIRE(ri::iter(events)->par_group_by<int>(byDigit, 4) == ri::iter(events)->group_by<int>(byDigit));
+
+    std::vector<std::string> words = {"b", "a", "c", "a", "b", "a"};
+    auto wordCounts = ri::iter(words)->par_counts(2);
+    REQUIRE(wordCounts["a"] == 3);
+    REQUIRE(wordCounts["b"] == 2);
+    REQUIRE(wordCounts["c"] == 1);
+}
+
 TEST_CASE("min and max")
 {
     std::vector<int> a = {3, 0, 1, 2};
@@ -375,6 +1002,437 @@ TEST_CASE("lines")
 }
 */
 
+TEST_CASE("par_map")
+{
+    auto square = [](const int& x) { return x * x; };
+
+    auto expected = ri::gen(0, 10000)->map<int>(square)->collect<std::vector>();
+
+    REQUIRE(ri::gen(0, 10000)->par_map<int>(square, 4, 16)->collect<std::vector>() == expected);
+    REQUIRE(ri::gen(0, 10000)->par_map<int>(square)->collect<std::vector>() == expected);
+    REQUIRE(ri::empty<int>()->par_map<int>(square)->count() == 0);
+
+    // Stops pulling from an endless source once dropped
+    REQUIRE(*ri::gen(0)->par_map<int>(square, 3, 8)->nth(50) == 2500);
+
+    // Errors surface in order, after the results before them
+    auto failing = ri::gen(0, 10)->par_map<int>([](const int& x) {
+        if (x == 5)
+            throw std::runtime_error("five");
+        return x;
+    }, 2, 4);
+
+    REQUIRE(*failing->nth(4) == 4);
+    REQUIRE_THROWS_AS(failing->next(), std::runtime_error);
+    REQUIRE(!failing->next());
+}
+
+TEST_CASE("share")
+{
+    auto consume = [](std::shared_ptr<ri::SharedSource<int>> source, size_t threads) {
+        std::vector<int> sums(threads);
+        std::vector<std::thread> workers;
+
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers.emplace_back([&sums, i, worker = source->worker()] {
+                sums[i] = worker->filter([](auto x) { return x % 3 != 0; })
+                    ->fold<int>(0, [](auto acc, auto x) { return acc + x; });
+            });
+        }
+
+        for (auto& worker : workers)
+            worker.join();
+
+        return std::accumulate(sums.begin(), sums.end(), 0);
+    };
+
+    auto expected = ri::gen(0, 50000)
+        ->filter([](auto x) { return x % 3 != 0; })
+        ->fold<int>(0, [](auto acc, auto x) { return acc + x; });
+
+    std::vector<int> v = ri::gen(0, 50000)->collect<std::vector>();
+
+    auto fromVector = ri::iter(v)->share(1000);
+    REQUIRE(fromVector->indexed());
+    REQUIRE(consume(fromVector, 4) == expected);
+
+    auto fromRange = ri::gen(0, 50000)->map<int>([](auto x) { return x; })->share();
+    REQUIRE(fromRange->indexed());
+    REQUIRE(consume(fromRange, 3) == expected);
+
+    auto fromGenerator = ri::gen(0)->take(50000)->share(64);
+    REQUIRE(!fromGenerator->indexed());
+    REQUIRE(consume(fromGenerator, 4) == expected);
+
+    // Either way, the shared iterator's items are handed out
+    auto upstream = ri::iter(v);
+    REQUIRE(upstream->share()->indexed());
+    REQUIRE(!upstream->next());
+
+    auto endless = ri::gen(0);
+    auto batched = endless->take(10)->share(4);
+    REQUIRE(batched->worker()->count() == 10);
+    REQUIRE(*endless->next() == 10);
+
+    // Slices of a container yield references into it
+    auto slice = ri::iter(v)->slice(10, 12);
+    REQUIRE(slice->next() == &v[10]);
+    REQUIRE(slice->next() == &v[11]);
+    REQUIRE(!slice->next());
+    REQUIRE(ri::gen(0, 10)->slice(8, 20)->collect<std::vector>() == std::vector<int>{8, 9});
+}
+
+TEST_CASE("observe")
+{
+    std::vector<std::vector<int>> chunks;
+    std::vector<int> seen;
+    int pushed = 0;
+
+    auto observer = ri::observe<int>()
+        .inspect([&](int) { pushed++; })
+        .filter([](int x) { return x % 2 == 0; })
+        .map([](int x) { return x * 10; })
+        .scan(0, [](int acc, int x) { return acc + x; })
+        .inspect([&](int x) { seen.push_back(x); })
+        .take(3)
+        .chunks(2)
+        .for_each([&](const std::vector<int>& chunk) { chunks.push_back(chunk); });
+
+    // Evens are 0, 2, 4 -> 0, 20, 40 -> running sums 0, 20, 60
+    for (int i = 0; i < 100; i++)
+    {
+        if (!observer->on_next(i))
+            break;
+    }
+
+    REQUIRE(pushed == 5);
+    REQUIRE(seen == std::vector<int>{0, 20, 60});
+
+    // take() completed downstream, which flushed the last chunk
+    REQUIRE(chunks == std::vector<std::vector<int>>{{0, 20}, {60}});
+
+    observer->on_complete();
+    REQUIRE(chunks.size() == 2);
+
+    struct Collect : ri::Observer<std::string>
+    {
+        std::vector<std::string> items;
+        int completed = 0;
+
+        bool on_next(const std::string& item) override
+        {
+            items.push_back(item);
+            return true;
+        }
+
+        void on_complete() override
+        {
+            completed++;
+        }
+    };
+
+    auto collect = std::make_shared<Collect>();
+
+    ri::gen(0, 5)->push_into(ri::observe<int>()
+        .map([](int x) { return std::to_string(x); })
+        .subscribe(collect));
+
+    REQUIRE(collect->items == std::vector<std::string>{"0", "1", "2", "3", "4"});
+    REQUIRE(collect->completed == 1);
+}
+
+TEST_CASE("channel")
+{
+    auto [tx, rx] = ri::channel<int>(16);
+
+    std::vector<std::thread> producers;
+    std::atomic<int> failed(0);
+
+    for (int p = 0; p < 4; p++)
+    {
+        producers.emplace_back([p, tx, &failed] {
+            for (int i = 0; i < 10000; i++)
+                failed += !tx.send(p * 10000 + i);
+        });
+    }
+
+    // The receiver ends once every sender copy is gone
+    tx.close();
+
+    std::thread mapper;
+    auto [results, collected] = ri::channel<long>(8);
+
+    mapper = std::thread([rx = rx, results = std::move(results)]() mutable {
+        rx->map<long>([](auto x) { return long(x) * 2; })
+            ->for_each([&](auto x) { results.send(x); });
+    });
+
+    auto items = collected->collect<std::vector>();
+
+    for (auto& producer : producers)
+        producer.join();
+
+    mapper.join();
+
+    REQUIRE(failed == 0);
+
+    std::sort(items.begin(), items.end());
+    REQUIRE(items.size() == 40000);
+    REQUIRE(items.front() == 0);
+    REQUIRE(items.back() == 2 * 39999);
+    REQUIRE(std::adjacent_find(items.begin(), items.end()) == items.end());
+
+    // Sending fails once no receiver is left
+    auto [orphan, dropped] = ri::channel<int>(2);
+    REQUIRE(orphan.try_send(1));
+    REQUIRE(orphan.try_send(2));
+    REQUIRE(!orphan.try_send(3));
+    dropped.reset();
+    REQUIRE(!orphan.send(4));
+}
+
+TEST_CASE("lines")
+{
+    auto path = unique_temp_path("ri_lines_test.txt");
+    std::ofstream(path.string()) << "one\ntwo\n\nfour";
+
+    auto it = ri::lines(path);
+
+    REQUIRE(*it->next() == "one");
+
+    auto copy = it->clone();
+
+    REQUIRE(*it->next() == "two");
+    REQUIRE(*it->next() == "");
+    REQUIRE(*it->next() == "four");
+    REQUIRE(!it->next());
+
+    REQUIRE(copy->collect<std::vector>() == std::vector<std::string>{"two", "", "four"});
+    REQUIRE(!ri::lines(path / "missing")->next());
+
+    ri::fs::remove(path);
+
+    // Files that can't be mapped are read through a stream
+    REQUIRE(ri::lines("/proc/self/status")->next()->rfind("Name:", 0) == 0);
+
+    int fds[2];
+    REQUIRE(::pipe(fds) == 0);
+    REQUIRE(::write(fds[1], "a\nb\n", 4) == 4);
+    ::close(fds[1]);
+
+    auto piped = ri::lines("/dev/fd/" + std::to_string(fds[0]));
+    REQUIRE(piped->collect<std::vector>() == std::vector<std::string>{"a", "b"});
+    ::close(fds[0]);
+}
+
+TEST_CASE("stage")
+{
+    auto expected = ri::gen(0, 100000)
+        ->map<int>([](auto x) { return x * 3; })
+        ->filter([](auto x) { return x % 2 == 0; })
+        ->collect<std::vector>();
+
+    auto staged = ri::gen(0, 100000)
+        ->stage(256, 16)
+        ->map<int>([](auto x) { return x * 3; })
+        ->stage()
+        ->filter([](auto x) { return x % 2 == 0; })
+        ->collect<std::vector>();
+
+    REQUIRE(staged == expected);
+
+    // Dropping a stage early stops its producer thread
+    auto endless = ri::gen(0)->stage(64, 8);
+    REQUIRE(*endless->nth(100) == 100);
+    endless.reset();
+
+    REQUIRE(ri::empty<int>()->stage()->count() == 0);
+}
+
+TEST_CASE("clone")
+{
+    std::vector<int> a = {1, 2, 3, 4};
+    auto it = ri::iter(a)->map<int>([](auto x) { return x * 2; })->skip(1);
+
+    REQUIRE(*it->next() == 4);
+
+    auto copy = it->clone();
+
+    REQUIRE(*it->next() == 6);
+    REQUIRE(*it->next() == 8);
+    REQUIRE(*copy->next() == 6);
+    REQUIRE(*copy->next() == 8);
+    REQUIRE(!copy->next());
+
+    auto cycled = ri::iter(a)->filter([](auto x) { return x > 2; })->cycle();
+    REQUIRE(cycled->take(5)->collect<std::vector>() == std::vector<int>{3, 4, 3, 4, 3});
+}
+
+#if defined(__cpp_impl_coroutine)
+ri::generator<int> fibonacci()
+{
+    int a = 0;
+    int b = 1;
+
+    while (true)
+    {
+        co_yield a;
+        b = a + b;
+        a = b - a;
+    }
+}
+
+ri::generator<std::string> words(std::string text)
+{
+    size_t pos = 0;
+
+    while (pos < text.size())
+    {
+        auto space = text.find(' ', pos);
+
+        if (space == std::string::npos)
+            space = text.size();
+
+        co_yield text.substr(pos, space - pos);
+        pos = space + 1;
+    }
+}
+
+TEST_CASE("coroutine generator")
+{
+    auto fib = fibonacci()->take(8)->collect<std::vector>();
+    REQUIRE(fib == std::vector<int>{0, 1, 1, 2, 3, 5, 8, 13});
+
+    auto lengths = words("a pipeline of words")->map<size_t>([](auto& w) { return w.size(); });
+    REQUIRE(lengths->collect<std::vector>() == std::vector<size_t>{1, 8, 2, 5});
+
+    std::vector<std::string> texts = {"x y", "", "z"};
+    auto all = ri::iter(texts)->flat_map<std::string>([](auto& t) { return words(t); });
+    REQUIRE(all->collect<std::vector>() == std::vector<std::string>{"x", "y", "z"});
+
+    // Finished generators hand their frames back for reuse
+    auto cached = ri::FramePool::local().cached();
+    words("reuse")->count();
+    REQUIRE(ri::FramePool::local().cached() == cached);
+    REQUIRE(cached > 0);
+}
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__linux__)
+ri::Task<void> write_chunks(int fd, std::vector<std::string> chunks)
+{
+    for (auto& chunk : chunks)
+    {
+        REQUIRE(::write(fd, chunk.data(), chunk.size()) == ssize_t(chunk.size()));
+        co_await ri::EventLoop::current().yield();
+    }
+
+    ::close(fd);
+}
+
+ri::Task<int> doubled_later(int x)
+{
+    for (int i = 0; i < x % 3; i++)
+        co_await ri::EventLoop::current().yield();
+
+    co_return x * 2;
+}
+
+ri::Task<void> wake_on_readable(int fd, int& woken)
+{
+    co_await ri::EventLoop::current().readable(fd);
+    woken++;
+}
+
+ri::Task<void> fail_later()
+{
+    co_await ri::EventLoop::current().yield();
+    throw std::runtime_error("failed");
+}
+
+TEST_CASE("async pipeline")
+{
+    ri::EventLoop loop;
+    int fds[2];
+
+    REQUIRE(::pipe(fds) == 0);
+
+    loop.spawn(write_chunks(fds[1], {"a\nbb", "b\nccc\n", "dddd"}));
+
+    auto lengths = loop.block_on(ri::async_lines(fds[0])
+            ->map<size_t>([](auto& line) { return line.size(); })
+            ->filter([](auto n) { return n > 1; })
+            ->collect<std::vector>());
+
+    ::close(fds[0]);
+    REQUIRE(lengths == std::vector<size_t>{3, 3, 4});
+
+    auto doubled = loop.block_on(ri::async_iter(ri::gen(0, 10))
+            ->buffer_unordered<int>(doubled_later, 4)
+            ->collect<std::vector>());
+
+    std::sort(doubled.begin(), doubled.end());
+    REQUIRE(doubled == ri::gen(0, 10)->map<int>([](auto x) { return x * 2; })->collect<std::vector>());
+}
+
+TEST_CASE("async many pipelines")
+{
+    ri::EventLoop loop;
+    std::vector<int> readers;
+    size_t total = 0;
+
+    for (int i = 0; i < 64; i++)
+    {
+        int fds[2];
+        REQUIRE(::pipe(fds) == 0);
+        readers.push_back(fds[0]);
+        loop.spawn(write_chunks(fds[1], {"x\n", std::to_string(i) + "\n", "y\n"}));
+        loop.spawn(ri::async_lines(fds[0])->take(2)->for_each([&](auto&) { total++; }));
+    }
+
+    loop.run();
+
+    for (auto fd : readers)
+        ::close(fd);
+
+    REQUIRE(total == 128);
+}
+
+TEST_CASE("async event loop")
+{
+    REQUIRE_THROWS_AS(ri::EventLoop::current(), std::logic_error);
+
+    ri::EventLoop loop;
+    int fds[2];
+    int woken = 0;
+
+    REQUIRE(::pipe(fds) == 0);
+
+    // Both waiters on the same fd are woken
+    loop.spawn(wake_on_readable(fds[0], woken));
+    loop.spawn(wake_on_readable(fds[0], woken));
+    loop.spawn(write_chunks(fds[1], {"x"}));
+    loop.run();
+
+    ::close(fds[0]);
+    REQUIRE(woken == 2);
+
+    // A failed task's frame goes back to the pool, and the loop stays
+    // usable. The first failure only warms the pool up.
+    loop.spawn(fail_later());
+    REQUIRE_THROWS_AS(loop.run(), std::runtime_error);
+
+    auto cached = ri::FramePool::local().cached();
+
+    loop.spawn(fail_later());
+    REQUIRE_THROWS_AS(loop.run(), std::runtime_error);
+    REQUIRE_THROWS_AS(ri::EventLoop::current(), std::logic_error);
+    REQUIRE(ri::FramePool::local().cached() == cached);
+    REQUIRE(loop.block_on(doubled_later(4)) == 8);
+}
+#endif
+
 TEST_CASE("eq")
 {
     REQUIRE(ri::gen(1,10)->eq(ri::gen(1,10)));